@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ledd.h"
+
+// Phase beacons for installations without NTP. The leader multicasts its
+// monotonic clock once a second as "ledd-beacon <seq> <ms>". Followers
+// estimate the offset of that timeline from their own clock with a small
+// PI filter (a software PLL): the proportional part follows the measured
+// offset, the integral part learns the rate difference between the two
+// crystals, so the estimate does not lag between beacons. Large errors,
+// like the first beacon or a restarted leader, step the estimate instead.
+// Patterns are then aligned to the leader's timeline like -S aligns them
+// to the wall clock.
+
+#define BEACON_INTERVAL_MS 1000
+#define BEACON_STEP_US     50000  // Errors above this step the estimate
+#define BEACON_KP_SHIFT    1      // Proportional gain 1/2
+#define BEACON_KI_SHIFT    3      // Integral gain 1/8
+
+static int beacon_fd = -1;
+static int beacon_leader;
+static struct sockaddr_in beacon_group;
+static unsigned long beacon_seq;
+static uint64_t beacon_next;
+static int beacon_locked;
+static int64_t beacon_offset_us;  // Leader timeline minus now_ms(), us
+static int64_t beacon_freq_us;    // Learned drift per beacon
+struct beacon_stats beacon_stats;
+
+// "[leader:]<group>:<port>", followers join the group on every interface
+int beacon_open(const char *spec) {
+	struct ip_mreq mreq;
+	int one = 1;
+
+	if (strncmp(spec, "leader:", 7) == 0) {
+		beacon_leader = 1;
+		spec += 7;
+	}
+	if (strchr(spec, ':') == NULL || net_parse_inet(spec, &beacon_group) == -1 ||
+	    !IN_MULTICAST(ntohl(beacon_group.sin_addr.s_addr))) {
+		syslog(LOG_ERR, "Invalid beacon group %s", spec);
+		return -1;
+	}
+
+	beacon_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (beacon_fd < 0) {
+		return -1;
+	}
+	if (beacon_leader) {
+		unsigned char ttl = 1, loop = 1;  // Stay on the LAN, reach followers on this host
+		setsockopt(beacon_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+		setsockopt(beacon_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+		return beacon_fd;
+	}
+
+	// Several followers may share a host
+	struct sockaddr_in any = beacon_group;
+	any.sin_addr.s_addr = htonl(INADDR_ANY);
+	setsockopt(beacon_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	mreq.imr_multiaddr = beacon_group.sin_addr;
+	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+	if (bind(beacon_fd, (struct sockaddr *)&any, sizeof(any)) < 0 ||
+	    setsockopt(beacon_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+		syslog(LOG_ERR, "Failed to join beacon group %s: %s", spec, strerror(errno));
+		close(beacon_fd);
+		beacon_fd = -1;
+		return -1;
+	}
+	return beacon_fd;
+}
+
+void beacon_close(void) {
+	if (beacon_fd >= 0) {
+		close(beacon_fd);
+		beacon_fd = -1;
+	}
+}
+
+// Leaders send a beacon when one is due, returns the next deadline (0 for
+// followers)
+uint64_t beacon_service(uint64_t now) {
+	char msg[MAX_BUF];
+
+	if (beacon_fd < 0 || !beacon_leader) {
+		return 0;
+	}
+	if (now >= beacon_next) {
+		int len = snprintf(msg, sizeof(msg), "ledd-beacon %lu %llu", ++beacon_seq,
+		                   (unsigned long long)now);
+		if (sendto(beacon_fd, msg, (size_t)len, 0, (struct sockaddr *)&beacon_group,
+		           sizeof(beacon_group)) == len) {
+			beacon_stats.sent++;
+		}
+		beacon_next = now + BEACON_INTERVAL_MS;
+	}
+	return beacon_next;
+}
+
+// Feed received beacons to the filter. Returns 1 and the leader's timeline
+// minus now_ms() in ms when the estimate changed.
+int beacon_read(uint64_t now, int64_t *offset_ms) {
+	char msg[MAX_BUF];
+	int updated = 0;
+	ssize_t len;
+
+	while ((len = recv(beacon_fd, msg, sizeof(msg) - 1, 0)) >= 0) {
+		unsigned long seq;
+		unsigned long long leader;
+
+		msg[len] = '\0';
+		if (beacon_leader || sscanf(msg, "ledd-beacon %lu %llu", &seq, &leader) != 2) {
+			continue;
+		}
+		beacon_stats.received++;
+
+		int64_t measured = ((int64_t)leader - (int64_t)now) * 1000;
+		int64_t err = measured - beacon_offset_us;
+		if (!beacon_locked || err > BEACON_STEP_US || err < -BEACON_STEP_US) {
+			beacon_offset_us = measured;
+			beacon_freq_us = 0;
+			beacon_locked = 1;
+			beacon_stats.steps++;
+		} else {
+			beacon_freq_us += err / (1 << BEACON_KI_SHIFT);
+			beacon_offset_us += err / (1 << BEACON_KP_SHIFT) + beacon_freq_us;
+		}
+		beacon_stats.error_us = err;
+		updated = 1;
+	}
+	if (updated) {
+		*offset_ms = (beacon_offset_us + (beacon_offset_us < 0 ? -500 : 500)) / 1000;
+	}
+	return updated;
+}
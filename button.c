@@ -0,0 +1,109 @@
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+
+#include "ledd.h"
+
+#define BUTTON_EVENT_BATCH 16
+
+int button_open(struct button *b) {
+	b->fd = gpio_request_input(b->gpio, b->active_low, b->debounce_ms * 1000);
+	if (b->fd < 0) {
+		return -1;
+	}
+
+	// A button held while we start (stuck, or the user still holding it from
+	// a previous gesture) must not count until it has been released once
+	b->pressed = gpio_get_line_value(b->fd) == 1;
+	b->ignore = b->pressed;
+	b->count = 0;
+	b->long_armed = 0;
+	b->long_deadline = 0;
+	b->gap_deadline = 0;
+	return 0;
+}
+
+void button_close(struct button *b) {
+	if (b->fd >= 0) {
+		close(b->fd);
+		b->fd = -1;
+	}
+}
+
+static void button_finish(struct button *b, enum press_kind kind) {
+	int count = b->count;
+	b->count = 0;
+	b->long_armed = 0;
+	b->long_deadline = 0;
+	b->gap_deadline = 0;
+	button_event(b, kind, count);
+}
+
+static void button_edge(struct button *b, const struct gpio_v2_line_event *ev, uint64_t now) {
+	// Edge ids are logical, the kernel already applied ACTIVE_LOW
+	int pressed = ev->id == GPIO_V2_LINE_EVENT_RISING_EDGE;
+	if (pressed == b->pressed) {
+		return;
+	}
+	b->pressed = pressed;
+
+	if (b->ignore) {
+		if (!pressed) {
+			b->ignore = 0;
+		}
+		return;
+	}
+
+	if (pressed) {
+		b->count++;
+		b->press_ts = ev->timestamp_ns;
+		b->long_deadline = now + b->long_ms;
+		b->gap_deadline = 0;
+		button_feedback(b);
+		return;
+	}
+
+	// Measure the hold time from the edge timestamps rather than from when
+	// we got around to reading them, so a late wakeup cannot turn a short
+	// press into a long one or the other way round
+	uint64_t held_ms = (ev->timestamp_ns - b->press_ts) / 1000000;
+	b->long_deadline = 0;
+	button_feedback(b);
+	if (b->long_armed || held_ms >= b->long_ms) {
+		button_finish(b, PRESS_LONG);
+	} else {
+		b->gap_deadline = now + b->multi_gap_ms;
+	}
+}
+
+void button_handle_events(struct button *b, uint64_t now) {
+	struct gpio_v2_line_event ev[BUTTON_EVENT_BATCH];
+	int n;
+
+	while ((n = gpio_read_events(b->fd, ev, BUTTON_EVENT_BATCH)) > 0) {
+		for (int i = 0; i < n; i++) {
+			button_edge(b, &ev[i], now);
+		}
+	}
+	if (n < 0) {
+		syslog(LOG_ERR, "Failed to read events for GPIO %d", b->gpio);
+	}
+}
+
+void button_handle_timeout(struct button *b, uint64_t now) {
+	if (b->long_deadline && now >= b->long_deadline) {
+		b->long_deadline = 0;
+		b->long_armed = 1;
+		button_feedback(b);
+	}
+	if (b->gap_deadline && now >= b->gap_deadline) {
+		button_finish(b, b->count > 1 ? PRESS_MULTI : PRESS_SHORT);
+	}
+}
+
+uint64_t button_next_deadline(const struct button *b) {
+	if (b->long_deadline) {
+		return b->long_deadline;
+	}
+	return b->gap_deadline;
+}
@@ -0,0 +1,92 @@
+#include <string.h>
+
+#include "ledd.h"
+
+// Channel levels below this are off on outputs that can only switch
+#define COLOR_ON_THRESHOLD 64
+
+struct color {
+	const char *name;
+	uint8_t rgb[3];
+};
+
+static const struct color colors[COLOR_COUNT] = {
+	{ "off",     {   0,   0,   0 } },
+	{ "red",     { 255,   0,   0 } },
+	{ "green",   {   0, 255,   0 } },
+	{ "blue",    {   0,   0, 255 } },
+	{ "yellow",  { 255, 255,   0 } },
+	{ "amber",   { 255,  96,   0 } },
+	{ "orange",  { 255,  48,   0 } },
+	{ "cyan",    {   0, 255, 255 } },
+	{ "magenta", { 255,   0, 255 } },
+	{ "purple",  { 128,   0, 255 } },
+	{ "white",   { 255, 255, 255 } },
+};
+
+// Environment suffixes of the channels, in rgb[] order
+static const char *const channel_names[GROUP_MAX_CHANNELS] = { "r", "g", "b" };
+
+int color_lookup(const char *name) {
+	for (int i = 0; i < COLOR_COUNT; i++) {
+		if (strcmp(colors[i].name, name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+const char *color_name(int color) {
+	return colors[color].name;
+}
+
+// Channel levels of a color, in r, g, b order
+const uint8_t *color_rgb(int color) {
+	return colors[color].rgb;
+}
+
+// Build an RGB group from the gpio_led_r/g/b entries and precompute the
+// channel levels of every named color, so that a color change is a table
+// lookup. Outputs without PWM get plain on/off levels.
+int group_init_rgb(struct led_group *g, const struct led *leds, int count, int pwm) {
+	g->count = 0;
+	for (int c = 0; c < GROUP_MAX_CHANNELS; c++) {
+		g->members[c] = -1;
+		for (int i = 0; i < count; i++) {
+			if (strcmp(leds[i].name, channel_names[c]) == 0) {
+				g->members[c] = i;
+				g->count++;
+				break;
+			}
+		}
+	}
+	if (g->count == 0) {
+		return -1;
+	}
+
+	for (int i = 0; i < COLOR_COUNT; i++) {
+		for (int c = 0; c < GROUP_MAX_CHANNELS; c++) {
+			uint8_t level = colors[i].rgb[c];
+			if (!pwm) {
+				level = level >= COLOR_ON_THRESHOLD ? LEVEL_ON : LEVEL_OFF;
+			}
+			g->table[i][c] = level;
+		}
+	}
+	return 0;
+}
+
+// Channel of a pattern for one member of the group. Each step is scaled by
+// the channel's level in its own color, or in "color" for steps without one.
+void group_pattern(struct pattern *dst, const struct pattern *src, const struct led_group *g,
+                   int channel, int color) {
+	*dst = *src;
+	if (dst->ext != NULL) {
+		return;  // Shared step list, readouts show on every channel alike
+	}
+	for (int i = 0; i < dst->nsteps; i++) {
+		int c = dst->steps[i].color != COLOR_INHERIT ? dst->steps[i].color : color;
+		uint8_t level = g->table[c][channel];
+		dst->steps[i].level = (uint8_t)((dst->steps[i].level * level + 127) / LEVEL_ON);
+	}
+}
@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+
+#include "ledd.h"
+
+// Ingenic SoCs register one gpiochip per 32-line port, so a global GPIO
+// number maps to /dev/gpiochip<gpio / 32> at offset gpio % 32.
+#define GPIO_LINES_PER_CHIP 32
+
+static int gpio_chip_open(int gpio, unsigned int *offset) {
+	char path[MAX_BUF];
+	snprintf(path, sizeof(path), "/dev/gpiochip%d", gpio / GPIO_LINES_PER_CHIP);
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		syslog(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
+		return -1;
+	}
+	*offset = gpio % GPIO_LINES_PER_CHIP;
+	return fd;
+}
+
+int gpio_request_input(int gpio, int active_low, unsigned int debounce_us) {
+	struct gpio_v2_line_request req;
+	unsigned int offset;
+	int chip = gpio_chip_open(gpio, &offset);
+	if (chip < 0) {
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.offsets[0] = offset;
+	req.num_lines = 1;
+	strncpy(req.consumer, GPIO_CONSUMER, sizeof(req.consumer) - 1);
+	req.config.flags = GPIO_V2_LINE_FLAG_INPUT |
+	                   GPIO_V2_LINE_FLAG_EDGE_RISING |
+	                   GPIO_V2_LINE_FLAG_EDGE_FALLING |
+	                   GPIO_V2_LINE_FLAG_EVENT_CLOCK_HTE;
+	if (active_low) {
+		req.config.flags |= GPIO_V2_LINE_FLAG_ACTIVE_LOW;
+	}
+	if (debounce_us > 0) {
+		req.config.num_attrs = 1;
+		req.config.attrs[0].mask = 1;
+		req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_DEBOUNCE;
+		req.config.attrs[0].attr.debounce_period_us = debounce_us;
+	}
+
+	// Hardware timestamps need an HTE provider, fall back to CLOCK_MONOTONIC
+	int ret = ioctl(chip, GPIO_V2_GET_LINE_IOCTL, &req);
+	if (ret < 0) {
+		req.config.flags &= ~(uint64_t)GPIO_V2_LINE_FLAG_EVENT_CLOCK_HTE;
+		ret = ioctl(chip, GPIO_V2_GET_LINE_IOCTL, &req);
+	}
+	if (ret < 0 && req.config.num_attrs > 0) {
+		syslog(LOG_WARNING, "GPIO %d: debounce not supported, using raw edges", gpio);
+		req.config.num_attrs = 0;
+		ret = ioctl(chip, GPIO_V2_GET_LINE_IOCTL, &req);
+	}
+	close(chip);
+
+	if (ret < 0) {
+		syslog(LOG_ERR, "Failed to request GPIO %d as input: %s", gpio, strerror(errno));
+		return -1;
+	}
+
+	fcntl(req.fd, F_SETFL, fcntl(req.fd, F_GETFL) | O_NONBLOCK);
+	return req.fd;
+}
+
+int gpio_get_line_value(int fd) {
+	struct gpio_v2_line_values values;
+	memset(&values, 0, sizeof(values));
+	values.mask = 1;
+	if (ioctl(fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0) {
+		return -1;
+	}
+	return (int)(values.bits & 1);
+}
+
+int gpio_read_events(int fd, struct gpio_v2_line_event *ev, int max) {
+	ssize_t len = read(fd, ev, sizeof(*ev) * (size_t)max);
+	if (len < 0) {
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	}
+	return (int)(len / (ssize_t)sizeof(*ev));
+}
+
+// sysfs backend, lines are exported through the thingino "gpio" helper and
+// written one value file at a time
+
+// Export the line, then make it an output
+static int export_gpio(int gpio) {
+	char command[MAX_BUF];
+	snprintf(command, sizeof(command), "gpio export %d", gpio);
+	if (system(command) != 0) {
+		return -1;
+	}
+	snprintf(command, sizeof(command), "gpio output %d", gpio);
+	return system(command) != 0 ? -1 : 0;
+}
+
+static int unexport_gpio(int gpio) {
+	char command[MAX_BUF];
+	snprintf(command, sizeof(command), "gpio unexport %d", gpio);
+	return system(command);
+}
+
+static int set_gpio_value(int gpio, int value) {
+	char buf[MAX_BUF];
+	snprintf(buf, sizeof(buf), "/sys/class/gpio/gpio%d/value", gpio);
+	FILE *fd = fopen(buf, "w");
+	if (fd == NULL) {
+		syslog(LOG_ERR, "Failed to open GPIO value for GPIO %d", gpio);
+		return -1;
+	}
+	fprintf(fd, "%d", value);
+	fclose(fd);
+	return 0;
+}
+
+static int sysfs_open(struct led *leds, int count) {
+	for (int i = 0; i < count; i++) {
+		if (export_gpio(leds[i].gpio) != 0) {
+			syslog(LOG_ERR, "Failed to export GPIO %d", leds[i].gpio);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int sysfs_write(struct led *leds, int count) {
+	int ret = 0;
+	for (int i = 0; i < count; i++) {
+		if (!leds[i].dirty) {
+			continue;
+		}
+		leds[i].dirty = 0;
+		int on = leds[i].level != LEVEL_OFF;
+		if (set_gpio_value(leds[i].gpio, on ^ leds[i].active_low) == -1) {
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+static void sysfs_close(struct led *leds, int count) {
+	for (int i = 0; i < count; i++) {
+		unexport_gpio(leds[i].gpio);
+	}
+}
+
+const struct led_backend backend_sysfs = {
+	.name = "sysfs",
+	.caps = 0,
+	.open = sysfs_open,
+	.write = sysfs_write,
+	.close = sysfs_close,
+};
+
+// Request output lines on one gpiochip with a single line request, every
+// line starting out inactive. Returns the request fd.
+int gpio_request_outputs(const int *gpios, const int *active_low, int count) {
+	struct gpio_v2_line_request req;
+	unsigned int offset;
+
+	if (count <= 0 || count > GPIO_V2_LINES_MAX) {
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	strncpy(req.consumer, GPIO_CONSUMER, sizeof(req.consumer) - 1);
+	req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+
+	int chip = gpios[0] / GPIO_LINES_PER_CHIP;
+	int fd = gpio_chip_open(gpios[0], &offset);
+	if (fd < 0) {
+		return -1;
+	}
+
+	// Polarity is per line, so active low lines get their own attribute
+	uint64_t low_mask = 0;
+	for (int i = 0; i < count; i++) {
+		if (gpios[i] / GPIO_LINES_PER_CHIP != chip) {
+			syslog(LOG_ERR, "GPIO %d is not on gpiochip%d", gpios[i], chip);
+			close(fd);
+			return -1;
+		}
+		req.offsets[req.num_lines++] = (unsigned int)(gpios[i] % GPIO_LINES_PER_CHIP);
+		if (active_low[i]) {
+			low_mask |= 1ULL << i;
+		}
+	}
+	if (low_mask) {
+		struct gpio_v2_line_config_attribute *a = &req.config.attrs[req.config.num_attrs++];
+		a->mask = low_mask;
+		a->attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+		a->attr.flags = GPIO_V2_LINE_FLAG_OUTPUT | GPIO_V2_LINE_FLAG_ACTIVE_LOW;
+	}
+	struct gpio_v2_line_config_attribute *a = &req.config.attrs[req.config.num_attrs++];
+	a->mask = (req.num_lines == 64) ? ~0ULL : (1ULL << req.num_lines) - 1;
+	a->attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+	a->attr.values = 0;
+
+	int ret = ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &req);
+	close(fd);
+	if (ret < 0) {
+		syslog(LOG_ERR, "Failed to request lines on gpiochip%d: %s", chip, strerror(errno));
+		return -1;
+	}
+	return req.fd;
+}
+
+int gpio_set_values(int fd, uint64_t mask, uint64_t bits) {
+	struct gpio_v2_line_values values = { .bits = bits, .mask = mask };
+	return ioctl(fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) < 0 ? -1 : 0;
+}
+
+// Character device backend. All LED lines on one gpiochip share a single
+// line request, so any number of them change with one SET_VALUES ioctl.
+
+struct chip_request {
+	int chip;
+	int fd;
+	int nlines;
+};
+
+static struct chip_request chip_requests[MAX_LEDS];
+static int chip_request_count;
+
+static void chardev_close(struct led *leds, int count) {
+	(void)leds;
+	(void)count;
+	for (int i = 0; i < chip_request_count; i++) {
+		close(chip_requests[i].fd);
+	}
+	chip_request_count = 0;
+}
+
+static int chardev_request(struct chip_request *cr, struct led *leds, int count) {
+	int gpios[MAX_LEDS];
+	int active_low[MAX_LEDS];
+	int n = 0;
+
+	for (int i = 0; i < count; i++) {
+		if (leds[i].req != cr - chip_requests) {
+			continue;
+		}
+		leds[i].bit = n;
+		gpios[n] = leds[i].gpio;
+		active_low[n] = leds[i].active_low;
+		n++;
+	}
+
+	cr->fd = gpio_request_outputs(gpios, active_low, n);
+	cr->nlines = n;
+	return cr->fd < 0 ? -1 : 0;
+}
+
+static int chardev_open(struct led *leds, int count) {
+	chip_request_count = 0;
+	for (int i = 0; i < count; i++) {
+		int chip = leds[i].gpio / GPIO_LINES_PER_CHIP;
+		int r;
+		for (r = 0; r < chip_request_count; r++) {
+			if (chip_requests[r].chip == chip) {
+				break;
+			}
+		}
+		if (r == chip_request_count) {
+			chip_requests[r].chip = chip;
+			chip_requests[r].fd = -1;
+			chip_request_count++;
+		}
+		leds[i].req = r;
+	}
+
+	for (int r = 0; r < chip_request_count; r++) {
+		if (chardev_request(&chip_requests[r], leds, count) == -1) {
+			chip_request_count = r;
+			chardev_close(leds, count);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int chardev_write(struct led *leds, int count) {
+	struct gpio_v2_line_values values[MAX_LEDS];
+	int ret = 0;
+
+	memset(values, 0, sizeof(values[0]) * (size_t)chip_request_count);
+	for (int i = 0; i < count; i++) {
+		if (!leds[i].dirty) {
+			continue;
+		}
+		leds[i].dirty = 0;
+		values[leds[i].req].mask |= 1ULL << leds[i].bit;
+		if (leds[i].level != LEVEL_OFF) {
+			values[leds[i].req].bits |= 1ULL << leds[i].bit;
+		}
+	}
+
+	for (int r = 0; r < chip_request_count; r++) {
+		if (values[r].mask == 0) {
+			continue;
+		}
+		if (gpio_set_values(chip_requests[r].fd, values[r].mask, values[r].bits) == -1) {
+			syslog(LOG_ERR, "Failed to set values on gpiochip%d: %s",
+			       chip_requests[r].chip, strerror(errno));
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+const struct led_backend backend_chardev = {
+	.name = "chardev",
+	.caps = LED_CAP_SOFT_PWM,
+	.open = chardev_open,
+	.write = chardev_write,
+	.close = chardev_close,
+};
+
+// Raw line sets for drivers that multiplex lines themselves
+
+static void chardev_lines_release(int handle) {
+	close(handle);
+}
+
+const struct line_ops lines_chardev = {
+	.name = "chardev",
+	.request = gpio_request_outputs,
+	.set = gpio_set_values,
+	.release = chardev_lines_release,
+};
+
+// The mock keeps the last values and a write count per line set instead of
+// touching hardware, for benchmarks and simulation
+
+static struct mock_lines mock_lines[MOCK_LINE_SETS];
+static int mock_line_count;
+
+static int mock_lines_request(const int *gpios, const int *active_low, int count) {
+	(void)gpios;
+	(void)active_low;
+	if (mock_line_count == MOCK_LINE_SETS) {
+		return -1;
+	}
+	memset(&mock_lines[mock_line_count], 0, sizeof(mock_lines[0]));
+	mock_lines[mock_line_count].nlines = count;
+	return mock_line_count++;
+}
+
+static int mock_lines_set(int handle, uint64_t mask, uint64_t bits) {
+	struct mock_lines *ml = &mock_lines[handle];
+	ml->bits = (ml->bits & ~mask) | (bits & mask);
+	ml->writes++;
+	return 0;
+}
+
+static void mock_lines_release(int handle) {
+	(void)handle;
+}
+
+const struct mock_lines *gpio_mock_lines(int handle) {
+	return &mock_lines[handle];
+}
+
+const struct line_ops lines_mock = {
+	.name = "mock",
+	.request = mock_lines_request,
+	.set = mock_lines_set,
+	.release = mock_lines_release,
+};
+
+static const struct led_backend *const backends[] = {
+	&backend_sysfs,
+	&backend_chardev,
+	&backend_mmio,
+};
+
+const struct led_backend *backend_find(const char *name) {
+	for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		if (strcmp(backends[i]->name, name) == 0) {
+			return backends[i];
+		}
+	}
+	return NULL;
+}
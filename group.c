@@ -0,0 +1,82 @@
+#include <string.h>
+
+#include "ledd.h"
+
+// Choreographies for a strip of LEDs. Every member gets its own pattern but
+// all of them share one period and are pushed with the same epoch, so the
+// members stay phase-locked and their edges fall on the same deadlines.
+
+static const char *const choreo_names[CHOREO_COUNT] = {
+	[CHOREO_CHASER] = "chaser",
+	[CHOREO_BOUNCE] = "bounce",
+	[CHOREO_ALTERNATE] = "alternate",
+};
+
+int choreo_lookup(const char *name) {
+	for (int i = 0; i < CHOREO_COUNT; i++) {
+		if (strcmp(choreo_names[i], name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// A pattern spec, or the name of a choreography for the strip
+int pattern_valid(const char *spec) {
+	struct pattern check;
+	return choreo_lookup(spec) != -1 || pattern_parse(spec, 1000, &check) == 0;
+}
+
+// Build a pattern from on/off slots, merging runs of equal slots into steps
+static void pattern_from_slots(struct pattern *p, const uint8_t *slots, int nslots, uint32_t slot_ms) {
+	p->ext = NULL;
+	p->nsteps = 0;
+	p->period = slot_ms * (uint32_t)nslots;
+	p->phase = 0;
+	for (int i = 0; i < nslots; i++) {
+		uint8_t level = slots[i] ? LEVEL_ON : LEVEL_OFF;
+		if (p->nsteps > 0 && p->steps[p->nsteps - 1].level == level) {
+			p->steps[p->nsteps - 1].ms += slot_ms;
+			continue;
+		}
+		p->steps[p->nsteps++] = (struct step){ level, slot_ms, EASE_STEP, COLOR_INHERIT };
+	}
+}
+
+// Pattern of one member of a count LED strip. Chaser and alternate are the
+// same pattern on every member shifted by a per-member phase offset, bounce
+// lights the ends once and the middle members twice per cycle.
+void choreo_pattern(struct pattern *p, enum choreo c, int member, int count, uint32_t slot_ms) {
+	uint8_t slots[2 * MAX_LEDS];
+	int nslots;
+
+	if (slot_ms == 0) {
+		slot_ms = 1;
+	}
+	if (count < 2) {
+		pattern_blink(p, slot_ms, slot_ms);
+		return;
+	}
+
+	switch (c) {
+	case CHOREO_CHASER:
+		nslots = count;
+		memset(slots, 0, sizeof(slots));
+		slots[0] = 1;
+		pattern_from_slots(p, slots, nslots, slot_ms);
+		p->phase = (p->period - (uint32_t)member * slot_ms) % p->period;
+		break;
+	case CHOREO_BOUNCE:
+		nslots = 2 * (count - 1);
+		memset(slots, 0, sizeof(slots));
+		slots[member] = 1;
+		slots[(nslots - member) % nslots] = 1;
+		pattern_from_slots(p, slots, nslots, slot_ms);
+		break;
+	case CHOREO_ALTERNATE:
+	default:
+		pattern_blink(p, slot_ms, slot_ms);
+		p->phase = (uint32_t)(member % 2) * slot_ms;
+		break;
+	}
+}
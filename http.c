@@ -0,0 +1,442 @@
+#define _GNU_SOURCE  // accept4, strcasestr
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ledd.h"
+
+// Tiny HTTP server run from the main loop. Connections live in a fixed
+// table with a fixed request buffer each; while the table is full the
+// listening socket is not polled, so clients wait in the backlog instead of
+// costing memory. A request, body included, must fit the buffer. Responses
+// are small and go out with one writev() from the handler's buffer, a
+// client that cannot take them at once is dropped. HTTP/1.1 clients and
+// HTTP/1.0 ones asking for keep-alive keep their connection.
+
+#define HTTP_IDLE_MS 5000  // Drop connections that send nothing for this long
+
+// "[<host>:]<port>", the host defaults to loopback
+int net_parse_inet(const char *addr, struct sockaddr_in *sin) {
+	char host[MAX_BUF] = "127.0.0.1";
+	const char *port = strrchr(addr, ':');
+
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	if (port != NULL) {
+		snprintf(host, sizeof(host), "%.*s", (int)(port - addr), addr);
+		port++;
+	} else {
+		port = addr;
+	}
+	long num = strtol(port, NULL, 10);
+	if (num <= 0 || num > 65535 || inet_pton(AF_INET, host, &sin->sin_addr) != 1) {
+		return -1;
+	}
+	sin->sin_port = htons((uint16_t)num);
+	return 0;
+}
+
+static void http_init(struct http_server *s, http_handler handler) {
+	memset(s, 0, sizeof(*s));
+	s->fd = -1;
+	for (int i = 0; i < HTTP_MAX_CONN; i++) {
+		s->conns[i].fd = -1;
+	}
+	s->handler = handler;
+}
+
+// "<path>" for a Unix socket, "[<host>:]<port>" for TCP on loopback by default
+static int http_addr(const char *addr, struct sockaddr_storage *ss, socklen_t *len) {
+	memset(ss, 0, sizeof(*ss));
+	if (addr[0] == '/') {
+		struct sockaddr_un *sun = (struct sockaddr_un *)ss;
+		if (strlen(addr) >= sizeof(sun->sun_path)) {
+			return -1;
+		}
+		sun->sun_family = AF_UNIX;
+		snprintf(sun->sun_path, sizeof(sun->sun_path), "%s", addr);
+		*len = sizeof(*sun);
+		return 0;
+	}
+	if (net_parse_inet(addr, (struct sockaddr_in *)ss) == -1) {
+		return -1;
+	}
+	*len = sizeof(struct sockaddr_in);
+	return 0;
+}
+
+int http_listen(struct http_server *s, const char *addr, http_handler handler) {
+	struct sockaddr_storage ss;
+	socklen_t len;
+	int one = 1;
+
+	http_init(s, handler);
+
+	if (http_addr(addr, &ss, &len) == -1) {
+		return -1;
+	}
+	int fd = socket(ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (ss.ss_family == AF_UNIX) {
+		unlink(addr);
+	} else {
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	}
+	if (bind(fd, (struct sockaddr *)&ss, len) < 0) {
+		syslog(LOG_ERR, "Failed to bind %s: %s", addr, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if (listen(fd, HTTP_MAX_CONN) < 0) {
+		close(fd);
+		return -1;
+	}
+	s->fd = fd;
+	return 0;
+}
+
+// Serve on a socket that is already listening, handed over by a supervisor
+int http_adopt(struct http_server *s, int fd, http_handler handler) {
+	int type;
+	socklen_t len = sizeof(type);
+
+	http_init(s, handler);
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0 || type != SOCK_STREAM) {
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	s->fd = fd;
+	return 0;
+}
+
+static void http_drop(struct http_server *s, struct http_conn *c) {
+	close(c->fd);
+	c->fd = -1;
+	s->nconns--;
+}
+
+void http_close(struct http_server *s) {
+	for (int i = 0; i < HTTP_MAX_CONN; i++) {
+		if (s->conns[i].fd >= 0) {
+			http_drop(s, &s->conns[i]);
+		}
+	}
+	if (s->fd >= 0) {
+		close(s->fd);
+		s->fd = -1;
+	}
+}
+
+// Fill pollfds for the listening socket (while there is room) and every
+// connection, returns how many were used
+int http_pollfds(const struct http_server *s, struct pollfd *pfds) {
+	int n = 0;
+
+	if (s->fd < 0) {
+		return 0;
+	}
+	pfds[n++] = (struct pollfd){ .fd = s->nconns < HTTP_MAX_CONN ? s->fd : -1, .events = POLLIN };
+	for (int i = 0; i < HTTP_MAX_CONN; i++) {
+		pfds[n++] = (struct pollfd){ .fd = s->conns[i].fd, .events = POLLIN };
+	}
+	return n;
+}
+
+uint64_t http_next_deadline(const struct http_server *s) {
+	uint64_t next = 0;
+	for (int i = 0; i < HTTP_MAX_CONN; i++) {
+		if (s->conns[i].fd >= 0 && (next == 0 || s->conns[i].deadline < next)) {
+			next = s->conns[i].deadline;
+		}
+	}
+	return next;
+}
+
+static const char *http_reason(int status) {
+	switch (status) {
+	case 200: return "OK";
+	case 400: return "Bad Request";
+	case 403: return "Forbidden";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	case 413: return "Payload Too Large";
+	case 431: return "Request Header Fields Too Large";
+	default: return "Internal Server Error";
+	}
+}
+
+// Returns 0 if the connection stays open
+static int http_respond(struct http_server *s, struct http_conn *c, const struct http_response *resp,
+                        int keep) {
+	char head[192];
+	int len = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\n"
+	                   "Content-Length: %d\r\nConnection: %s\r\n\r\n",
+	                   resp->status, http_reason(resp->status),
+	                   resp->type ? resp->type : "text/plain", resp->len,
+	                   keep ? "keep-alive" : "close");
+	struct iovec iov[2] = {
+		{ .iov_base = head, .iov_len = (size_t)len },
+		{ .iov_base = (void *)resp->body, .iov_len = (size_t)resp->len },
+	};
+	if (writev(c->fd, iov, resp->len > 0 ? 2 : 1) != len + resp->len) {
+		syslog(LOG_WARNING, "HTTP client too slow, response dropped");
+		keep = 0;
+	}
+	if (!keep) {
+		http_drop(s, c);
+		return -1;
+	}
+	return 0;
+}
+
+static void http_error(struct http_server *s, struct http_conn *c, int status) {
+	struct http_response resp = { .status = status, .body = "", .len = 0 };
+	http_respond(s, c, &resp, 0);
+}
+
+// Value of a header, NULL if it is missing
+static const char *http_header(const char *head, const char *name) {
+	size_t len = strlen(name);
+	for (const char *p = strchr(head, '\n'); p != NULL; p = strchr(p + 1, '\n')) {
+		if (strncasecmp(p + 1, name, len) == 0 && p[1 + len] == ':') {
+			return p + 2 + len + strspn(p + 2 + len, " \t");
+		}
+	}
+	return NULL;
+}
+
+// Handle the request at the start of the buffer if it is complete. Returns
+// 1 if one was handled and the connection is still open, 0 if more is
+// needed, -1 if the connection was closed.
+static int http_dispatch(struct http_server *s, struct http_conn *c) {
+	struct http_request req;
+	struct http_response resp = { .status = 404, .body = "", .len = 0 };
+	char *end = strstr(c->buf, "\r\n\r\n");
+	int head_len;
+
+	if (end != NULL) {
+		head_len = (int)(end - c->buf) + 4;
+	} else if ((end = strstr(c->buf, "\n\n")) != NULL) {
+		head_len = (int)(end - c->buf) + 2;
+	} else {
+		if (c->len == (int)sizeof(c->buf) - 1) {
+			http_error(s, c, 431);
+			return -1;
+		}
+		return 0;
+	}
+	char term = *end;
+	*end = '\0';
+
+	const char *cl = http_header(c->buf, "Content-Length");
+	long body_len = cl ? strtol(cl, NULL, 10) : 0;
+	if (body_len < 0 || head_len + body_len > (long)sizeof(c->buf) - 1) {
+		http_error(s, c, 413);
+		return -1;
+	}
+	if (c->len < head_len + body_len) {
+		*end = term;  // Wait for the rest of the body
+		return 0;
+	}
+
+	char *sp1 = strchr(c->buf, ' ');
+	char *sp2 = sp1 ? strchr(sp1 + 1, ' ') : NULL;
+	if (sp1 == NULL || sp2 == NULL || sp1 - c->buf >= (int)sizeof(req.method) ||
+	    sp2 - sp1 - 1 >= (int)sizeof(req.path)) {
+		http_error(s, c, 400);
+		return -1;
+	}
+	snprintf(req.method, sizeof(req.method), "%.*s", (int)(sp1 - c->buf), c->buf);
+	snprintf(req.path, sizeof(req.path), "%.*s", (int)(sp2 - sp1 - 1), sp1 + 1);
+	char *query = strchr(req.path, '?');
+	if (query != NULL) {
+		*query++ = '\0';
+	}
+	req.query = query ? query : "";
+
+	// The body is terminated in place for the handler, the byte after it
+	// is saved for a pipelined request
+	char *body = c->buf + head_len;
+	char saved = body[body_len];
+	body[body_len] = '\0';
+	req.body = body;
+	req.body_len = (int)body_len;
+	req.local = c->local;
+
+	const char *conn = http_header(c->buf, "Connection");
+	int keep = strncmp(sp2 + 1, "HTTP/1.1", 8) == 0 ? !(conn && strncasecmp(conn, "close", 5) == 0) :
+	           conn != NULL && strncasecmp(conn, "keep-alive", 10) == 0;
+
+	s->handler(&req, &resp);
+	if (http_respond(s, c, &resp, keep) == -1) {
+		return -1;
+	}
+
+	body[body_len] = saved;
+	c->len -= head_len + (int)body_len;
+	memmove(c->buf, body + body_len, (size_t)c->len + 1);
+	return 1;
+}
+
+// Unix socket clients are on this machine, and so are TCP ones on the
+// loopback network or connecting from the address they connected to
+static int http_local(int fd, const struct sockaddr_storage *peer) {
+	struct sockaddr_in self;
+	socklen_t len = sizeof(self);
+
+	if (peer->ss_family == AF_UNIX) {
+		return 1;
+	}
+	if (peer->ss_family != AF_INET) {
+		return 0;
+	}
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)peer;
+	if ((ntohl(sin->sin_addr.s_addr) >> 24) == 127) {
+		return 1;
+	}
+	return getsockname(fd, (struct sockaddr *)&self, &len) == 0 && self.sin_family == AF_INET &&
+	       self.sin_addr.s_addr == sin->sin_addr.s_addr;
+}
+
+static void http_accept(struct http_server *s, uint64_t now) {
+	while (s->nconns < HTTP_MAX_CONN) {
+		struct sockaddr_storage peer;
+		socklen_t len = sizeof(peer);
+		int fd = accept4(s->fd, (struct sockaddr *)&peer, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			return;
+		}
+		for (int i = 0; i < HTTP_MAX_CONN; i++) {
+			struct http_conn *c = &s->conns[i];
+			if (c->fd < 0) {
+				c->fd = fd;
+				c->len = 0;
+				c->local = http_local(fd, &peer);
+				c->deadline = now + HTTP_IDLE_MS;
+				s->nconns++;
+				break;
+			}
+		}
+	}
+}
+
+static void http_read(struct http_server *s, struct http_conn *c, uint64_t now) {
+	ssize_t len = read(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - (size_t)c->len);
+	if (len <= 0) {
+		if (len == 0 || (errno != EAGAIN && errno != EINTR)) {
+			http_drop(s, c);
+		}
+		return;
+	}
+	c->len += (int)len;
+	c->buf[c->len] = '\0';
+	c->deadline = now + HTTP_IDLE_MS;
+
+	while (c->len > 0 && http_dispatch(s, c) == 1) {
+	}
+}
+
+// Decode the value of "key" from "a=1&b=2" style parameters into out,
+// returns -1 if the key is missing
+int http_param(const char *params, const char *key, char *out, size_t size) {
+	size_t klen = strlen(key);
+
+	for (const char *p = params; *p != '\0'; ) {
+		if (strncmp(p, key, klen) != 0 || p[klen] != '=') {
+			p += strcspn(p, "&");
+			p += *p == '&';
+			continue;
+		}
+		size_t n = 0;
+		for (p += klen + 1; *p != '\0' && *p != '&' && n + 1 < size; p++) {
+			if (*p == '+') {
+				out[n++] = ' ';
+			} else if (*p == '%' && isxdigit((unsigned char)p[1]) && isxdigit((unsigned char)p[2])) {
+				char hex[3] = { p[1], p[2], '\0' };
+				out[n++] = (char)strtol(hex, NULL, 16);
+				p += 2;
+			} else {
+				out[n++] = *p;
+			}
+		}
+		out[n] = '\0';
+		return 0;
+	}
+	return -1;
+}
+
+// Handle what poll() reported on the fds from http_pollfds, and expire
+// idle connections
+void http_service(struct http_server *s, const struct pollfd *pfds, uint64_t now) {
+	if (s->fd < 0) {
+		return;
+	}
+	for (int i = 0; i < HTTP_MAX_CONN; i++) {
+		struct http_conn *c = &s->conns[i];
+		if (c->fd < 0 || pfds[1 + i].fd != c->fd) {
+			continue;
+		}
+		if (pfds[1 + i].revents & (POLLIN | POLLHUP | POLLERR)) {
+			http_read(s, c, now);
+		} else if (now >= c->deadline) {
+			http_drop(s, c);
+		}
+	}
+	if (pfds[0].revents & POLLIN) {
+		http_accept(s, now);
+	}
+}
+
+// Blocking request to another ledd before the loop runs. The response body
+// goes into out, returns its length or -1 unless the status is 200.
+int http_fetch(const char *addr, const char *method, const char *path, char *out, size_t size) {
+	struct sockaddr_storage ss;
+	struct timeval tv = { .tv_sec = HTTP_IDLE_MS / 1000 };
+	char buf[HTTP_REQ_MAX * 2];
+	socklen_t len;
+	size_t n = 0;
+	ssize_t got;
+
+	if (http_addr(addr, &ss, &len) == -1) {
+		return -1;
+	}
+	int fd = socket(ss.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	int req = snprintf(buf, sizeof(buf), "%s %s HTTP/1.0\r\nContent-Length: 0\r\n\r\n", method, path);
+	if (connect(fd, (struct sockaddr *)&ss, len) < 0 || write(fd, buf, (size_t)req) != req) {
+		close(fd);
+		return -1;
+	}
+	while (n + 1 < sizeof(buf) && (got = read(fd, buf + n, sizeof(buf) - 1 - n)) > 0) {
+		n += (size_t)got;
+	}
+	close(fd);
+	buf[n] = '\0';
+
+	const char *body = strstr(buf, "\r\n\r\n");
+	if (strncmp(buf, "HTTP/1.", 7) != 0 || strncmp(buf + 8, " 200 ", 5) != 0 || body == NULL) {
+		return -1;
+	}
+	return snprintf(out, size, "%s", body + 4);
+}
@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "ledd.h"
+
+// I2C LED controllers (PCA9633 and PCA9685 class). The driver keeps an image
+// of the chip's registers. A write builds the new image from all channels
+// and sends the changed span as one auto-increment burst, so any number of
+// channel changes in a tick cost one bus transaction, and a tick that
+// changes nothing costs none.
+
+// PCA9633
+#define PCA9633_MODE1    0x00
+#define PCA9633_MODE2    0x01
+#define PCA9633_PWM0     0x02
+#define PCA9633_GRPPWM   0x06
+#define PCA9633_GRPFREQ  0x07
+#define PCA9633_LEDOUT   0x08
+#define PCA9633_NREGS    0x09
+#define PCA9633_AI_ALL   0x80  // Auto-increment over all registers
+#define PCA9633_DMBLNK   0x20  // MODE2: group control is blinking
+#define PCA9633_OUTDRV   0x04  // MODE2: totem pole outputs
+#define PCA9633_LDR_OFF  0x0
+#define PCA9633_LDR_ON   0x1
+#define PCA9633_LDR_PWM  0x2
+#define PCA9633_LDR_GRP  0x3
+
+// PCA9685
+#define PCA9685_MODE1    0x00
+#define PCA9685_MODE2    0x01
+#define PCA9685_LED0     0x06  // ON_L, ON_H, OFF_L, OFF_H per channel
+#define PCA9685_NREGS    (PCA9685_LED0 + 4 * PCA9685_CHANNELS)
+#define PCA9685_AI       0x20  // MODE1: register auto-increment
+#define PCA9685_OUTDRV   0x04
+#define PCA9685_FULL     0x10  // Full on (ON_H) or full off (OFF_H)
+
+#define PCA9633_CHANNELS 4
+#define PCA9685_CHANNELS 16
+#define I2C_MAX_REGS     PCA9685_NREGS
+#define SMBUS_BLOCK_MAX  32
+
+#define I2C_OSC_SETTLE_US 500  // Oscillator start-up after SLEEP is cleared
+
+// Group blink period range of the PCA9633, GRPFREQ steps are 1/24 s
+#define PCA9633_BLINK_MIN_MS 42
+#define PCA9633_BLINK_MAX_MS 10666
+
+enum i2c_chip_type {
+	CHIP_PCA9633,
+	CHIP_PCA9685,
+};
+
+struct i2c_chip {
+	enum i2c_chip_type type;
+	int bus;              // -1 for the in-process mock
+	int addr;
+	int fd;
+	int smbus;            // Adapter only does SMBus (e.g. i2c-stub), burst in 32 byte blocks
+	int nchannels;
+	int nregs;
+	uint8_t regs[I2C_MAX_REGS];  // What the chip holds
+	int have_regs;               // regs[] is valid
+	uint32_t blink_period;       // Shared group blink, 0 when unused
+	uint32_t blink_on;
+	uint8_t blink_level[PCA9633_CHANNELS];
+	struct led *leds;            // The channels, to see who shares the blinker
+	int count;
+};
+
+static struct i2c_chip chip;
+struct i2c_stats i2c_stats;
+
+// In-process mock of the chip, receives the bursts instead of the bus
+uint8_t i2c_mock_regs[I2C_MAX_REGS];
+
+int i2c_parse(const char *spec, struct led *leds) {
+	char buf[MAX_BUF * 2];
+	char *save = NULL;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	char *bus = strtok_r(buf, ":", &save);
+	char *addr = strtok_r(NULL, ":", &save);
+	char *type = strtok_r(NULL, ":", &save);
+	char *names = strtok_r(NULL, ":", &save);
+	if (bus == NULL || addr == NULL || type == NULL) {
+		return -1;
+	}
+
+	memset(&chip, 0, sizeof(chip));
+	chip.fd = -1;
+	chip.bus = strcmp(bus, "mock") == 0 ? -1 : (int)strtol(bus, NULL, 10);
+	chip.addr = (int)strtol(addr, NULL, 0);
+	if (strcmp(type, "pca9633") == 0) {
+		chip.type = CHIP_PCA9633;
+		chip.nchannels = PCA9633_CHANNELS;
+		chip.nregs = PCA9633_NREGS;
+	} else if (strcmp(type, "pca9685") == 0) {
+		chip.type = CHIP_PCA9685;
+		chip.nchannels = PCA9685_CHANNELS;
+		chip.nregs = PCA9685_NREGS;
+	} else {
+		return -1;
+	}
+	if (chip.addr <= 0 || chip.addr > 0x7f) {
+		return -1;
+	}
+
+	// Channels are named ch<N> unless names are given, "-" skips a channel
+	int count = 0;
+	char *name = names ? strtok_r(names, ",", &save) : NULL;
+	for (int c = 0; c < chip.nchannels && count < MAX_LEDS; c++) {
+		if (names != NULL && name == NULL) {
+			break;
+		}
+		if (name == NULL || strcmp(name, "-") != 0) {
+			struct led *led = &leds[count++];
+			memset(led, 0, sizeof(*led));
+			if (name != NULL) {
+				snprintf(led->name, sizeof(led->name), "%s", name);
+			} else {
+				snprintf(led->name, sizeof(led->name), "ch%u", (unsigned char)c);
+			}
+			led->gpio = -1;
+			led->bit = c;
+		}
+		if (name != NULL) {
+			name = strtok_r(NULL, ",", &save);
+		}
+	}
+	return count;
+}
+
+static int i2c_transfer(const uint8_t *buf, int len) {
+	if (chip.bus == -1) {
+		memcpy(&i2c_mock_regs[buf[0] & ~PCA9633_AI_ALL], buf + 1, (size_t)(len - 1));
+		return 0;
+	}
+
+	if (!chip.smbus) {
+		struct i2c_msg msg = {
+			.addr = (uint16_t)chip.addr,
+			.flags = 0,
+			.len = (uint16_t)len,
+			.buf = (uint8_t *)buf,
+		};
+		struct i2c_rdwr_ioctl_data data = { .msgs = &msg, .nmsgs = 1 };
+		return ioctl(chip.fd, I2C_RDWR, &data) < 0 ? -1 : 0;
+	}
+
+	// SMBus I2C block writes carry at most 32 bytes after the register
+	for (int off = 1; off < len; off += SMBUS_BLOCK_MAX) {
+		union i2c_smbus_data block;
+		int n = len - off < SMBUS_BLOCK_MAX ? len - off : SMBUS_BLOCK_MAX;
+		uint8_t reg = (uint8_t)(buf[0] + off - 1);
+		block.block[0] = (uint8_t)n;
+		memcpy(&block.block[1], buf + off, (size_t)n);
+		struct i2c_smbus_ioctl_data args = {
+			.read_write = I2C_SMBUS_WRITE,
+			.command = reg,
+			.size = I2C_SMBUS_I2C_BLOCK_DATA,
+			.data = &block,
+		};
+		if (ioctl(chip.fd, I2C_SMBUS, &args) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Write the span of next[] that differs from the cached image in one burst
+static int i2c_sync(const uint8_t *next) {
+	int lo = 0, hi = chip.nregs - 1;
+
+	if (chip.have_regs) {
+		while (lo <= hi && next[lo] == chip.regs[lo]) {
+			lo++;
+		}
+		while (hi >= lo && next[hi] == chip.regs[hi]) {
+			hi--;
+		}
+		if (lo > hi) {
+			i2c_stats.skipped++;
+			return 0;
+		}
+	}
+
+	uint8_t buf[I2C_MAX_REGS + 1];
+	buf[0] = (uint8_t)lo;
+	if (chip.type == CHIP_PCA9633) {
+		buf[0] |= PCA9633_AI_ALL;
+	}
+	memcpy(buf + 1, next + lo, (size_t)(hi - lo + 1));
+	if (i2c_transfer(buf, hi - lo + 2) == -1) {
+		syslog(LOG_ERR, "I2C write to 0x%02x failed: %s", chip.addr, strerror(errno));
+		chip.have_regs = 0;  // Unknown state, rewrite everything next time
+		return -1;
+	}
+
+	memcpy(chip.regs + lo, next + lo, (size_t)(hi - lo + 1));
+	chip.have_regs = 1;
+	i2c_stats.bursts++;
+	i2c_stats.bytes += (unsigned long)(hi - lo + 2);
+	return 0;
+}
+
+static void pca9633_channel(uint8_t *next, const struct led *led) {
+	int c = led->bit;
+	int ldr;
+
+	if (led->hw_blink) {
+		next[PCA9633_PWM0 + c] = chip.blink_level[c];
+		ldr = PCA9633_LDR_GRP;
+	} else {
+		next[PCA9633_PWM0 + c] = led->level;
+		ldr = led->level == LEVEL_OFF ? PCA9633_LDR_OFF :
+		      led->level == LEVEL_ON ? PCA9633_LDR_ON : PCA9633_LDR_PWM;
+	}
+	next[PCA9633_LEDOUT] = (uint8_t)((next[PCA9633_LEDOUT] & ~(0x3 << (2 * c))) | (ldr << (2 * c)));
+}
+
+static void pca9685_channel(uint8_t *next, const struct led *led) {
+	uint8_t *r = &next[PCA9685_LED0 + 4 * led->bit];
+	uint16_t off = (uint16_t)((led->level * 4095 + LEVEL_ON / 2) / LEVEL_ON);
+
+	r[0] = 0;
+	r[1] = led->level == LEVEL_ON ? PCA9685_FULL : 0;
+	r[2] = (uint8_t)(off & 0xff);
+	r[3] = (uint8_t)((off >> 8) | (led->level == LEVEL_OFF ? PCA9685_FULL : 0));
+}
+
+static void i2c_group_blink(uint8_t *next) {
+	if (chip.type != CHIP_PCA9633) {
+		return;
+	}
+	if (chip.blink_period == 0) {
+		next[PCA9633_MODE2] &= (uint8_t)~PCA9633_DMBLNK;
+		return;
+	}
+	next[PCA9633_MODE2] |= PCA9633_DMBLNK;
+	next[PCA9633_GRPFREQ] = (uint8_t)(chip.blink_period * 24 / 1000 - 1);
+	next[PCA9633_GRPPWM] = (uint8_t)(chip.blink_on * 256 / chip.blink_period);
+}
+
+static int i2c_write(struct led *leds, int count) {
+	uint8_t next[I2C_MAX_REGS];
+	int blinking = 0;
+
+	memcpy(next, chip.regs, sizeof(next));
+	for (int i = 0; i < count; i++) {
+		blinking |= leds[i].hw_blink;
+		if (!leds[i].dirty) {
+			continue;
+		}
+		leds[i].dirty = 0;
+		if (chip.type == CHIP_PCA9633) {
+			pca9633_channel(next, &leds[i]);
+		} else {
+			pca9685_channel(next, &leds[i]);
+		}
+	}
+	if (!blinking) {
+		chip.blink_period = 0;
+	}
+	i2c_group_blink(next);
+	return i2c_sync(next);
+}
+
+// Whether a channel other than led runs on the group blinker
+static int i2c_blink_shared(const struct led *led) {
+	for (int i = 0; i < chip.count; i++) {
+		if (&chip.leds[i] != led && chip.leds[i].hw_blink) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Let the PCA9633 group blinker run plain on/off blinks. There is only one
+// group blinker, so every channel handed to it must share the timing, and
+// only a channel running on it alone may change it. Returns 2 when the
+// registers need rewriting for the blink, 1 when they already hold it.
+static int i2c_offload(struct led *led, const struct pattern *p) {
+	if (chip.type != CHIP_PCA9633 || p->ext != NULL || p->nsteps != 2 || p->phase != 0 ||
+	    p->steps[0].ease != EASE_STEP || p->steps[1].ease != EASE_STEP ||
+	    p->steps[0].level == LEVEL_OFF || p->steps[1].level != LEVEL_OFF ||
+	    p->period < PCA9633_BLINK_MIN_MS || p->period > PCA9633_BLINK_MAX_MS) {
+		led->hw_blink = 0;
+		return 0;
+	}
+
+	int retimed = chip.blink_period != p->period || chip.blink_on != p->steps[0].ms;
+	if (chip.blink_period != 0 && retimed && i2c_blink_shared(led)) {
+		led->hw_blink = 0;
+		return 0;
+	}
+	int changed = retimed || chip.blink_level[led->bit] != p->steps[0].level;
+	chip.blink_period = p->period;
+	chip.blink_on = p->steps[0].ms;
+	chip.blink_level[led->bit] = p->steps[0].level;
+	led->hw_blink = 1;
+	return changed ? 2 : 1;
+}
+
+static void i2c_release(void) {
+	if (chip.fd >= 0) {
+		close(chip.fd);
+		chip.fd = -1;
+	}
+}
+
+static int i2c_open(struct led *leds, int count) {
+	uint8_t init[I2C_MAX_REGS];
+
+	if (chip.bus != -1) {
+		char path[MAX_BUF];
+		unsigned long funcs = 0;
+		snprintf(path, sizeof(path), "/dev/i2c-%d", chip.bus);
+		chip.fd = open(path, O_RDWR | O_CLOEXEC);
+		if (chip.fd < 0) {
+			syslog(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
+			return -1;
+		}
+		if (ioctl(chip.fd, I2C_FUNCS, &funcs) < 0) {
+			funcs = I2C_FUNC_I2C;
+		}
+		if (!(funcs & I2C_FUNC_I2C)) {
+			if (!(funcs & I2C_FUNC_SMBUS_WRITE_I2C_BLOCK) ||
+			    ioctl(chip.fd, I2C_SLAVE, chip.addr) < 0) {
+				syslog(LOG_ERR, "%s supports neither I2C nor SMBus block writes", path);
+				close(chip.fd);
+				chip.fd = -1;
+				return -1;
+			}
+			chip.smbus = 1;
+		}
+	}
+
+	// Oscillator on, auto-increment, totem pole outputs, every channel off.
+	// MODE1 goes first on its own: it turns auto-increment on for the
+	// PCA9685, and the oscillator needs 500 us out of SLEEP before the
+	// channel registers are written.
+	memset(init, 0, sizeof(init));
+	if (chip.type == CHIP_PCA9633) {
+		init[PCA9633_MODE1] = 0x00;
+		init[PCA9633_MODE2] = PCA9633_OUTDRV;
+	} else {
+		init[PCA9685_MODE1] = PCA9685_AI;
+		init[PCA9685_MODE2] = PCA9685_OUTDRV;
+		for (int c = 0; c < PCA9685_CHANNELS; c++) {
+			init[PCA9685_LED0 + 4 * c + 3] = PCA9685_FULL;
+		}
+	}
+	for (int i = 0; i < count; i++) {
+		leds[i].hw_blink = 0;
+	}
+	chip.leds = leds;
+	chip.count = count;
+	chip.blink_period = 0;
+
+	uint8_t mode1[2] = { PCA9633_MODE1, init[PCA9633_MODE1] };
+	if (i2c_transfer(mode1, sizeof(mode1)) == -1) {
+		syslog(LOG_ERR, "I2C write to 0x%02x failed: %s", chip.addr, strerror(errno));
+		i2c_release();
+		return -1;
+	}
+	i2c_stats.bursts++;
+	i2c_stats.bytes += sizeof(mode1);
+	usleep(I2C_OSC_SETTLE_US);
+
+	// A chip that is absent or NAKs is tried again on the next open
+	chip.have_regs = 0;
+	if (i2c_sync(init) == -1) {
+		i2c_release();
+		return -1;
+	}
+	return 0;
+}
+
+static void i2c_close(struct led *leds, int count) {
+	(void)leds;
+	(void)count;
+	i2c_release();
+}
+
+const struct led_backend backend_i2c = {
+	.name = "i2c",
+	.caps = LED_CAP_PWM,
+	.frame_ms = 20,  // A short burst is about 1 ms at 100 kHz, 50 frames/s is plenty
+	.open = i2c_open,
+	.write = i2c_write,
+	.close = i2c_close,
+	.offload = i2c_offload,
+};
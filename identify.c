@@ -0,0 +1,333 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "ledd.h"
+
+// Authenticated UDP commands, so installers can make one camera among many
+// identify itself. A datagram is
+//
+//   <unix ms> identify [<seconds>] <hmac>
+//   <unix ms> pattern <spec> [<seconds>] <hmac>
+//
+// where <hmac> is the hex HMAC-SHA256, keyed with the shared key file, of
+// everything before the space in front of it. The timestamp must be within
+// IDENTIFY_WINDOW_MS of the local clock and newer than the last accepted
+// command, so captured datagrams cannot be replayed. A token bucket limits
+// how many datagrams are even looked at, so a flood costs a bounded amount
+// of CPU, and each loop wakeup reads only a few of them.
+
+#define IDENTIFY_MSG_MAX     256
+#define IDENTIFY_KEY_MAX     64
+#define IDENTIFY_WINDOW_MS   30000
+#define IDENTIFY_RATE_MS     200  // One token per 200 ms
+#define IDENTIFY_BURST       10
+#define IDENTIFY_PER_WAKEUP  4
+
+static int identify_fd = -1;
+static uint8_t key[IDENTIFY_KEY_MAX];
+static size_t key_len;
+static uint64_t last_stamp;
+static int tokens;
+static uint64_t tokens_at;
+struct identify_stats identify_stats;
+
+// SHA-256, FIPS 180-4
+
+struct sha256 {
+	uint32_t h[8];
+	uint8_t block[64];
+	size_t len;      // Bytes in block
+	uint64_t total;  // Bytes hashed
+};
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(struct sha256 *c) {
+	uint32_t w[64], v[8];
+
+	for (int i = 0; i < 16; i++) {
+		w[i] = (uint32_t)c->block[4 * i] << 24 | (uint32_t)c->block[4 * i + 1] << 16 |
+		       (uint32_t)c->block[4 * i + 2] << 8 | c->block[4 * i + 3];
+	}
+	for (int i = 16; i < 64; i++) {
+		uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+	memcpy(v, c->h, sizeof(v));
+	for (int i = 0; i < 64; i++) {
+		uint32_t t1 = v[7] + (ROR(v[4], 6) ^ ROR(v[4], 11) ^ ROR(v[4], 25)) +
+		              ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256_k[i] + w[i];
+		uint32_t t2 = (ROR(v[0], 2) ^ ROR(v[0], 13) ^ ROR(v[0], 22)) +
+		              ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+		memmove(v + 1, v, sizeof(v[0]) * 7);
+		v[4] += t1;
+		v[0] = t1 + t2;
+	}
+	for (int i = 0; i < 8; i++) {
+		c->h[i] += v[i];
+	}
+}
+
+static void sha256_init(struct sha256 *c) {
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	memcpy(c->h, iv, sizeof(iv));
+	c->len = 0;
+	c->total = 0;
+}
+
+static void sha256_update(struct sha256 *c, const void *data, size_t len) {
+	const uint8_t *p = data;
+	c->total += len;
+	while (len > 0) {
+		size_t n = sizeof(c->block) - c->len < len ? sizeof(c->block) - c->len : len;
+		memcpy(c->block + c->len, p, n);
+		c->len += n;
+		p += n;
+		len -= n;
+		if (c->len == sizeof(c->block)) {
+			sha256_block(c);
+			c->len = 0;
+		}
+	}
+}
+
+static void sha256_final(struct sha256 *c, uint8_t out[32]) {
+	uint64_t bits = c->total * 8;
+	uint8_t pad = 0x80;
+
+	sha256_update(c, &pad, 1);
+	pad = 0;
+	while (c->len != 56) {
+		sha256_update(c, &pad, 1);
+	}
+	for (int i = 7; i >= 0; i--) {
+		uint8_t b = (uint8_t)(bits >> (8 * i));
+		sha256_update(c, &b, 1);
+	}
+	for (int i = 0; i < 8; i++) {
+		out[4 * i] = (uint8_t)(c->h[i] >> 24);
+		out[4 * i + 1] = (uint8_t)(c->h[i] >> 16);
+		out[4 * i + 2] = (uint8_t)(c->h[i] >> 8);
+		out[4 * i + 3] = (uint8_t)c->h[i];
+	}
+}
+
+void hmac_sha256(const uint8_t *k, size_t klen, const void *msg, size_t len, uint8_t out[32]) {
+	uint8_t pad[64];
+	struct sha256 c;
+
+	// Keys are at most IDENTIFY_KEY_MAX (one block), so never need hashing
+	memset(pad, 0x36, sizeof(pad));
+	for (size_t i = 0; i < klen; i++) {
+		pad[i] ^= k[i];
+	}
+	sha256_init(&c);
+	sha256_update(&c, pad, sizeof(pad));
+	sha256_update(&c, msg, len);
+	sha256_final(&c, out);
+
+	for (size_t i = 0; i < sizeof(pad); i++) {
+		pad[i] ^= 0x36 ^ 0x5c;
+	}
+	sha256_init(&c);
+	sha256_update(&c, pad, sizeof(pad));
+	sha256_update(&c, out, 32);
+	sha256_final(&c, out);
+}
+
+int identify_open(const char *addr, const char *key_file) {
+	struct sockaddr_in sin;
+	uint8_t buf[IDENTIFY_KEY_MAX + 3];  // Room for CR LF and one byte too many
+
+	int fd = open(key_file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		syslog(LOG_ERR, "Failed to open key %s: %s", key_file, strerror(errno));
+		return -1;
+	}
+	ssize_t len = read(fd, buf, sizeof(buf));
+	close(fd);
+	while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r')) {
+		len--;
+	}
+	// A longer key would be cut here but hashed whole by the clients, and
+	// every command would fail to verify
+	if (len < 16 || len > IDENTIFY_KEY_MAX) {
+		syslog(LOG_ERR, "Key %s must be 16 to %d bytes", key_file, IDENTIFY_KEY_MAX);
+		memset(buf, 0, sizeof(buf));
+		return -1;
+	}
+	memcpy(key, buf, (size_t)len);
+	memset(buf, 0, sizeof(buf));
+	key_len = (size_t)len;
+
+	if (net_parse_inet(addr, &sin) == -1) {
+		return -1;
+	}
+	identify_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (identify_fd < 0) {
+		return -1;
+	}
+	// A small receive buffer bounds the backlog a flood leaves behind
+	int rcvbuf = 4096;
+	setsockopt(identify_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	if (bind(identify_fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		syslog(LOG_ERR, "Failed to bind %s: %s", addr, strerror(errno));
+		close(identify_fd);
+		identify_fd = -1;
+		return -1;
+	}
+	tokens = IDENTIFY_BURST;
+	return identify_fd;
+}
+
+void identify_close(void) {
+	if (identify_fd >= 0) {
+		close(identify_fd);
+		identify_fd = -1;
+	}
+	memset(key, 0, sizeof(key));
+}
+
+static int take_token(uint64_t now) {
+	if (tokens < IDENTIFY_BURST) {
+		uint64_t refill = (now - tokens_at) / IDENTIFY_RATE_MS;
+		tokens = refill >= (uint64_t)(IDENTIFY_BURST - tokens) ? IDENTIFY_BURST : tokens + (int)refill;
+		tokens_at += refill * IDENTIFY_RATE_MS;
+	}
+	if (tokens == 0) {
+		return 0;
+	}
+	if (tokens == IDENTIFY_BURST) {
+		tokens_at = now;
+	}
+	tokens--;
+	return 1;
+}
+
+static int hex_digit(char c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+// Check the trailing HMAC in constant time, then the timestamp
+static int identify_verify(char *msg, size_t len) {
+	uint8_t mac[32];
+	uint8_t diff = 0;
+	char *sep = strrchr(msg, ' ');
+
+	if (sep == NULL || msg + len - sep - 1 != 64) {
+		return -1;
+	}
+	hmac_sha256(key, key_len, msg, (size_t)(sep - msg), mac);
+	for (int i = 0; i < 32; i++) {
+		int hi = hex_digit(sep[1 + 2 * i]), lo = hex_digit(sep[2 + 2 * i]);
+		if (hi < 0 || lo < 0) {
+			return -1;
+		}
+		diff |= (uint8_t)(mac[i] ^ (hi << 4 | lo));
+	}
+	if (diff != 0) {
+		return -1;
+	}
+	*sep = '\0';
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	uint64_t wall = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+	uint64_t stamp = strtoull(msg, NULL, 10);
+	if (stamp <= last_stamp || stamp + IDENTIFY_WINDOW_MS < wall || stamp > wall + IDENTIFY_WINDOW_MS) {
+		identify_stats.replayed++;
+		return -1;
+	}
+	last_stamp = stamp;
+	return 0;
+}
+
+static int identify_parse(char *msg, struct identify_cmd *cmd) {
+	char *save = NULL;
+	strtok_r(msg, " ", &save);  // Timestamp
+	char *verb = strtok_r(NULL, " ", &save);
+	char *arg = strtok_r(NULL, " ", &save);
+	char *secs = NULL;
+
+	memset(cmd, 0, sizeof(*cmd));
+	if (verb == NULL) {
+		return -1;
+	}
+	if (strcmp(verb, "identify") == 0) {
+		cmd->identify = 1;
+		secs = arg;
+	} else if (strcmp(verb, "pattern") == 0 && arg != NULL) {
+		snprintf(cmd->spec, sizeof(cmd->spec), "%s", arg);
+		secs = strtok_r(NULL, " ", &save);
+	} else {
+		return -1;
+	}
+	if (secs != NULL) {
+		long s = strtol(secs, NULL, 10);
+		if (s <= 0 || s > 3600) {
+			return -1;
+		}
+		cmd->duration_ms = (uint32_t)s * 1000;
+	}
+	return 0;
+}
+
+// Read up to a few datagrams, returns 1 with the first valid command
+int identify_read(struct identify_cmd *cmd, uint64_t now) {
+	char msg[IDENTIFY_MSG_MAX + 1];
+
+	for (int i = 0; i < IDENTIFY_PER_WAKEUP; i++) {
+		ssize_t len = recv(identify_fd, msg, sizeof(msg), MSG_TRUNC);
+		if (len < 0) {
+			return 0;
+		}
+		identify_stats.received++;
+		if (!take_token(now)) {
+			identify_stats.limited++;
+			continue;
+		}
+		if (len > IDENTIFY_MSG_MAX) {
+			identify_stats.rejected++;
+			continue;
+		}
+		msg[len] = '\0';
+		if (identify_verify(msg, (size_t)len) == -1 || identify_parse(msg, cmd) == -1) {
+			identify_stats.rejected++;
+			continue;
+		}
+		identify_stats.accepted++;
+		return 1;
+	}
+	return 0;
+}
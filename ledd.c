@@ -6,198 +6,1736 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <syslog.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ledd.h"
 
-#define MAX_BUF 64
 #define FW_PRINTENV_CMD "fw_printenv | grep ^gpio_led_ | sort"
+#define FW_BUTTON_CMD "fw_printenv gpio_button_reset 2>/dev/null"
+#define LED_CACHE_FILE "/etc/ledd.leds"  // Copy of the gpio_led_* entries
+#define LISTEN_FDS_START 3  // First socket passed by the supervisor
+#define TAKEOVER_WAIT_MS 5000  // How long the old instance has to exit after handing over
+#define FILE_POLL_MS 100  // How often the monitored file is checked without inotify
+#define FEEDBACK_BLINK_MS 100  // Half period of the "long press armed" blink
+#define ACK_FLASH_MS 80  // Flash length acknowledging a recognised gesture
+#define SOFT_PWM_PERIOD_MS 10  // 100 Hz, duty cycle in 1 ms steps
+#define SOFT_PWM_FRAME_MS 40   // Animation frame cap while software PWM runs
+#define IDENTIFY_BLINK_MS 100   // Half period of the identify blink
+#define IDENTIFY_SHOW_MS 30000  // How long identify overlays last unless told
+#define READOUT_MAX_STEPS 256
+#define READOUT_BLINK_MS 250  // Flash length of blink codes
+#define READOUT_MORSE_MS 150  // Dot length of Morse
+#define READOUT_REPEAT 3
+#define DIAG_REPEAT 5  // Times a diagnostic code is shown
+#define DIAG_WRITE_FAILS 20  // Failed writes in a row that raise DIAG_WRITES
 
-static int gpio_pin = -1;
 static volatile sig_atomic_t keep_running = 1;
+static volatile sig_atomic_t stats_requested = 0;
 static double blink_interval = 1.0;  // Default blink interval in seconds
 static const char *monitor_file = "/var/run/boot"; // Default file to monitor
-static int active_low = 0;  // Default to active high (0 means active high)
-static int off_value = 1;  // Default off value, assuming active high
 
-// New flags
-static int file_was_present = 0;
-static int gpio_was_active = 0;  // Track if GPIO was being used for blinking
+// Outputs discovered from the gpio_led_* entries, the first one is the
+// status LED unless a color is in use
+static struct led leds[MAX_LEDS];
+static int led_count;
+static const struct led_backend *backend = &backend_sysfs;
+static struct led_group rgb_group;
+static int status_color = -1;  // Color of the status patterns, -1 for the plain LED
+static char boot_pattern[PATTERN_SPEC_MAX] = "blink";  // Pattern while the file exists
+static const char *strip_spec = NULL;  // Comma separated LED names of the strip
+static const char *matrix_spec = NULL;  // Rows and columns of a multiplexed matrix
+static const char *i2c_spec = NULL;  // I2C LED controller
+static const char *ws2812_spec = NULL;  // Addressable pixels on a spidev device
+static const char *sim_script = NULL;  // Run the script on a virtual clock, see sim.c
+static const char *trace_file = NULL;  // Chrome trace JSON written on exit and SIGUSR1
+static int trace_ftrace = 0;  // Mirror trace events to the ftrace marker
+static int strip[MAX_LEDS];  // LED indexes of the strip members, in order
+static int strip_count;
+static int soft_pwm = 0;  // Dim on/off outputs by toggling them
+static uint32_t frame_ms;  // Animation frame interval, 0 for keyframes only
+static uint32_t fade_ms = 250;  // Crossfade between patterns when dimming is possible
+static uint32_t resync_ms = 0;  // Rewrite every LED this often, 0 to trust the shadows
+static uint32_t coalesce_ms = 0;  // Collect events on the monitored file this long
+static int file_pending;  // Inotify mask collected since the first event of a burst
+static unsigned long file_pending_count;
+static const char *metrics_addr = NULL;  // Unix socket path or [host:]port for /metrics
+static const char *control_addr = NULL;  // Same for the control endpoint
+static struct http_server metrics_server = { .fd = -1 };
+static struct http_server control_server = { .fd = -1 };
+static struct http_server *const servers[] = { &metrics_server, &control_server };
+static int listen_fd_count = 0;  // Sockets inherited through LISTEN_FDS
+static char listen_fd_names[MAX_BUF * 2];  // LISTEN_FDNAMES, ':' separated
+static uint32_t idle_exit_ms = 0;  // Exit after this long with nothing to do, 0 to stay
+static int leave_leds = 0;  // Leave the LEDs as they are on the way out
+static const char *pid_file = "/var/run/ledd.pid";  // Locked while an instance runs
+static int pid_fd = -1;
+static int takeover = 0;  // Ask the running instance to hand over instead of giving up
+static char handover[PATTERN_SPEC_MAX + MAX_BUF];  // State the previous instance handed over
+#define SERVER_COUNT (int)(sizeof(servers) / sizeof(servers[0]))
+static char control_spec[PATTERN_SPEC_MAX];  // Pattern set through the control endpoint
+static uint64_t control_expires;  // 0 while it stays until cleared
+static uint32_t control_half_ms;  // Its interval
+static const char *identify_addr = NULL;  // [host:]port of the UDP identify listener
+static const char *identify_key = "/etc/ledd.key";  // Shared HMAC key of the fleet
+static int identify_fd = -1;
+static struct step readout_steps[READOUT_MAX_STEPS];  // Steps of the current readout
+static int readout_presses = 0;  // Button presses that read out the IP address, 0 for none
+
+// Failures ledd reports on its own LEDs, since syslog may not be running
+// yet. The code is the number of flashes, shown with the blink code timing
+// of readouts on whichever LEDs still work, and also written to the
+// kernel log.
+enum diag {
+	DIAG_NO_LEDS,     // No LEDs in any discovery source, nothing to blink
+	DIAG_CLAIM,       // Some LEDs could not be claimed, the others carry on
+	DIAG_WRITES,      // Writes keep failing at runtime
+	DIAG_ENV_CACHED,  // Environment unreadable, LEDs came from the cache
+	DIAG_COUNT,
+};
+
+static const struct {
+	int code;
+	const char *what;
+} diag_classes[DIAG_COUNT] = {
+	[DIAG_NO_LEDS] = { 2, "no LEDs found in fw_printenv or " LED_CACHE_FILE },
+	[DIAG_CLAIM] = { 3, "some LED GPIOs could not be claimed" },
+	[DIAG_WRITES] = { 4, "LED writes keep failing" },
+	[DIAG_ENV_CACHED] = { 5, "fw_printenv has no LEDs, using " LED_CACHE_FILE },
+};
+
+static int pending_diag = -1;  // enum diag for the loop to show, -1 for none
+static int write_failures;  // Backend writes failed in a row
+static int lazy_claim = 0;  // Claim the GPIOs only once something lights up
+static uint32_t release_ms = 0;  // Release them after this long dark, 0 to keep them
+static int leds_claimed = 0;
+static struct step diag_steps[PATTERN_MAX_STEPS * 2];
+static int clock_sync = 0;  // Align pattern cycles to the wall clock
+static int clock_fd = -1;  // timerfd cancelled when the wall clock is set
+static int64_t clock_offset;  // CLOCK_REALTIME (or the leader's clock) minus now_ms(), in ms
+static const char *beacon_spec = NULL;  // Multicast phase beacons, see beacon.c
+static int beacon_fd = -1;
+
+// Histogram bounds, in us for writes and ms for wakeup lateness
+static const uint32_t write_us_bounds[] = { 10, 50, 100, 500, 1000, 5000, 20000 };
+static const uint32_t late_ms_bounds[] = { 0, 1, 2, 5, 10, 50, 100 };
+
+struct led_stats led_stats = {
+	.write_us = { .bounds = write_us_bounds, .nbounds = 7 },
+	.late_ms = { .bounds = late_ms_bounds, .nbounds = 7 },
+};
+static int watch_fd = -1;  // inotify on the monitored file's directory, -1 to poll
+
+// Boot stages: what the status LED shows, driven by file and button events
+static const char *stage_file = NULL;  // State machine config, see stage.c
+static struct stage_machine stages;
+static int stage = 0;  // Current state, the first one at startup
+
+// Button input, disabled unless a GPIO is configured
+static struct button button = {
+	.gpio = -1,
+	.fd = -1,
+	.debounce_ms = 20,
+	.long_ms = 3000,
+	.multi_gap_ms = 400,
+};
+static const char *button_action = NULL;  // Run as "<action> <kind> <count>"
 
 // prototypes
-static void blink_led(int gpio_pin);
-static int export_gpio(int gpio);
-static int unexport_gpio(int gpio);
-static int set_gpio_value(int gpio, int value);
-static int get_gpio_pin_from_fw(void);
+static void blink_led(const char *spec, uint32_t half, uint64_t now);
+static int show_spec(int id, enum layer_prio prio, const char *spec, uint32_t half_ms,
+                     uint64_t now, uint32_t duration_ms);
+static void set_status_color(int color);
+static void control_handler(const struct http_request *req, struct http_response *resp);
+static void identify_apply(const struct identify_cmd *cmd, uint64_t now);
+static int show_readout(const char *text, enum readout_mode mode, int repeat, uint64_t now);
+static int local_ip(char *buf, size_t len);
+static int64_t wall_offset(void);
+static int clock_open(void);
+static void clock_changed(uint64_t now);
+static void clock_adjust(int64_t offset, uint64_t now);
+static void update_leds(uint64_t now, int all);
+static void write_leds(void);
+static void show_pattern(int id, enum layer_prio prio, const struct pattern *p,
+                         uint64_t now, uint32_t duration_ms);
+static void hide_pattern(int id);
+static void sync_pattern(int id, enum layer_prio prio, uint64_t now);
+static uint64_t leds_next_edge(void);
+static void check_monitored_file(uint64_t now, int reread);
+static void settle_file_events(uint64_t now);
+static void stage_event(enum stage_event ev, uint64_t now);
+static void enter_stage(int next, uint64_t now);
+static int watch_open(void);
+static int watch_read(unsigned long *count);
+static void log_stats(void);
+static void run_loop(void);
+static void run_action(const char *cmd, const char *kind, int count);
+static int parse_gpio_spec(const char *spec, int *active_low);
+static int parse_ms(const char *arg, unsigned int *out);
+static int resolve_strip(const char *spec);
+static void color_pixels(int color);
+static int get_button_from_fw(int *active_low);
+static int get_leds_from_fw(void);
+static int parse_led_entries(FILE *fp);
+static void save_led_cache(void);
+static int discover_leds(void);
+static int claim_leds(void);
+static int acquire_leds(void);
+static void release_leds(void);
+static int leds_dark(void);
+static void diag_log(enum diag d);
+static void diag_raise(enum diag d, uint64_t now);
 static void handle_signal(int sig);
 static void setup_signal_handling(void);
 static void init_daemon(void);
+static void inherit_sockets(void);
+static void adopt_sockets(void);
+static int lock_instance(void);
+static void write_pid(void);
+static void apply_handover(uint64_t now);
 static void reset_gpio_state(void);
-static double read_blink_interval_from_file(const char *file_path);
+static double read_blink_interval_from_file(const char *file_path, int *color,
+                                            char *pattern, size_t pattern_len);
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [options] <blink_interval> [file_to_monitor]\n"
+	        "  -k <gpio>[o]   Button GPIO (default: fw_printenv gpio_button_reset)\n"
+	        "  -a <action>    Run \"<action> short|long|multi <count>\" on button presses\n"
+	        "  -d <ms>        Button debounce period (default 20)\n"
+	        "  -l <ms>        Long press threshold (default 3000)\n"
+	        "  -g <ms>        Maximum gap between presses of a multi-press (default 400)\n"
+	        "  -B <backend>   Output backend: sysfs (default), chardev or mmio\n"
+	        "  -M <file>      GPIO registers for mmio (default /dev/mem)\n"
+	        "  -c <color>     Status color when gpio_led_r/g/b are present\n"
+	        "  -p <pattern>   Boot pattern: blink, breathe, pulse, heartbeat or keyframes\n"
+	        "                 \"<level>[@<color>]:<ms>[:<ease>],...\" (default blink),\n"
+	        "                 chaser, bounce or alternate run on the strip\n"
+	        "  -G <led,...>   LED names forming a strip, in order\n"
+	        "  -m <rows:cols> Drive a multiplexed matrix instead of gpio_led_* entries,\n"
+	        "                 e.g. 10,11,12:20o,21o,22o (LEDs are named r<row>c<col>)\n"
+	        "  -i <spec>      Drive an I2C LED controller instead of gpio_led_* entries,\n"
+	        "                 <bus|mock>:<addr>:<pca9633|pca9685>[:<name>,...]\n"
+	        "  -w <spec>      Drive WS2812 pixels on spidev instead of gpio_led_* entries,\n"
+	        "                 <bus>.<cs>|mock:<pixels>[:<order>] (pixels are named px<N>)\n"
+	        "  -s             Software PWM for dimming on/off outputs (chardev or mmio)\n"
+	        "  -x <ms>        Crossfade time between patterns when dimming (default 250)\n"
+	        "  -r <ms>        Rewrite every LED this often in case others touch the lines\n"
+	        "  -D <file>      Boot stages as a state machine, see stage.c\n"
+	        "  -W <ms>        Collect bursts of changes to the monitored file for this\n"
+	        "                 long and act on them once (default 0)\n"
+	        "  -T <script>    Simulate the script on a virtual clock and print the edges\n"
+	        "  -t <file>      Trace edges, wakeups and dispatch, written as Chrome trace\n"
+	        "                 JSON on exit and SIGUSR1\n"
+	        "  -F             Mirror trace events to the ftrace trace_marker\n"
+	        "  -P <addr>      Serve Prometheus metrics at /metrics on a Unix socket path\n"
+	        "                 or [<host>:]<port> (loopback by default)\n"
+	        "  -C <addr>      Serve the HTTP control endpoint, same address forms as -P\n"
+	        "  -u <addr>      Accept authenticated UDP identify commands on [<host>:]<port>\n"
+	        "  -K <file>      HMAC key for -u (default /etc/ledd.key)\n"
+	        "  -R <count>     Read out the IP address as blink codes on <count> presses\n"
+	        "  -Z <s>         Claim the GPIOs when something lights up and release them\n"
+	        "                 after <s> seconds dark, 0 to keep them (sysfs, chardev, mmio)\n"
+	        "  -E <s>         Exit after <s> seconds with nothing to show, leaving the\n"
+	        "                 LEDs as they are (for socket activation)\n"
+	        "  -S             Align blink cycles to the wall clock, so devices with\n"
+	        "                 synchronized clocks blink in phase\n"
+	        "  -b [leader:]<group>:<port>\n"
+	        "                 Align blink cycles to a leader's multicast beacons instead\n"
+	        "  -L <file>      Instance lock and pid file (default /var/run/ledd.pid)\n"
+	        "  -O             Take over from a running instance through its -C endpoint\n",
+	        prog);
+	exit(EXIT_FAILURE);
+}
 
 int main(int argc, char *argv[]) {
-	if (argc < 2 || argc > 3) {
-		fprintf(stderr, "Usage: %s <blink_interval> [file_to_monitor]\n", argv[0]);
-		exit(EXIT_FAILURE);
+	int opt;
+	while ((opt = getopt(argc, argv, "k:a:d:l:g:B:M:c:p:sx:r:G:m:i:w:T:t:FP:C:u:K:Sb:R:E:L:OZ:W:D:")) != -1) {
+		switch (opt) {
+		case 'k':
+			button.gpio = parse_gpio_spec(optarg, &button.active_low);
+			if (button.gpio < 0) {
+				fprintf(stderr, "Invalid button GPIO: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'a':
+			button_action = optarg;
+			break;
+		case 'd':
+		case 'l':
+		case 'g':
+		case 'x':
+		case 'W':
+		case 'r': {
+			unsigned int *dst = opt == 'd' ? &button.debounce_ms :
+			                    opt == 'l' ? &button.long_ms :
+			                    opt == 'g' ? &button.multi_gap_ms :
+			                    opt == 'x' ? &fade_ms :
+			                    opt == 'W' ? &coalesce_ms : &resync_ms;
+			if (parse_ms(optarg, dst) == -1) {
+				fprintf(stderr, "Invalid time for -%c: %s\n", opt, optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		}
+		case 'B':
+			backend = backend_find(optarg);
+			if (backend == NULL) {
+				fprintf(stderr, "Unknown backend: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'M':
+			gpio_mmio_path = optarg;
+			break;
+		case 'c':
+			status_color = color_lookup(optarg);
+			if (status_color == -1) {
+				fprintf(stderr, "Unknown color: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'p':
+			if (!pattern_valid(optarg)) {
+				fprintf(stderr, "Invalid pattern: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			snprintf(boot_pattern, sizeof(boot_pattern), "%s", optarg);
+			break;
+		case 'G':
+			strip_spec = optarg;
+			break;
+		case 'm':
+			matrix_spec = optarg;
+			break;
+		case 'i':
+			i2c_spec = optarg;
+			break;
+		case 'w':
+			ws2812_spec = optarg;
+			break;
+		case 'T':
+			sim_script = optarg;
+			break;
+		case 't':
+			trace_file = optarg;
+			break;
+		case 'F':
+			trace_ftrace = 1;
+			break;
+		case 'P':
+			metrics_addr = optarg;
+			break;
+		case 'C':
+			control_addr = optarg;
+			break;
+		case 'u':
+			identify_addr = optarg;
+			break;
+		case 'K':
+			identify_key = optarg;
+			break;
+		case 's':
+			soft_pwm = 1;
+			break;
+		case 'S':
+			clock_sync = 1;
+			break;
+		case 'E': {
+			char *end;
+			long secs = strtol(optarg, &end, 10);
+			if (*end != '\0' || secs <= 0 || secs > 86400) {
+				fprintf(stderr, "Invalid idle time: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			idle_exit_ms = (uint32_t)secs * 1000;
+			break;
+		}
+		case 'R':
+			readout_presses = atoi(optarg);
+			if (readout_presses < 2) {
+				fprintf(stderr, "Invalid press count: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'b':
+			beacon_spec = optarg;
+			clock_sync = 1;
+			break;
+		case 'Z': {
+			char *end;
+			long secs = strtol(optarg, &end, 10);
+			if (*end != '\0' || secs < 0 || secs > 86400) {
+				fprintf(stderr, "Invalid release time: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			lazy_claim = 1;
+			release_ms = (uint32_t)secs * 1000;
+			break;
+		}
+		case 'D':
+			stage_file = optarg;
+			break;
+		case 'L':
+			pid_file = optarg;
+			break;
+		case 'O':
+			takeover = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
 	}
 
+	if (argc - optind < 1 || argc - optind > 2) {
+		usage(argv[0]);
+	}
+	inherit_sockets();
+
 	char *endptr;
 	errno = 0;
-	blink_interval = strtod(argv[1], &endptr);
+	blink_interval = strtod(argv[optind], &endptr);
 	if (errno != 0 || *endptr != '\0' || blink_interval <= 0) {
-		fprintf(stderr, "Invalid blink interval: %s\n", argv[1]);
+		fprintf(stderr, "Invalid blink interval: %s\n", argv[optind]);
 		exit(EXIT_FAILURE);
 	}
 
 	// Set the file to monitor (default to /tmp/boot if not provided)
-	if (argc == 3) {
-		monitor_file = argv[2];
+	if (argc - optind == 2) {
+		monitor_file = argv[optind + 1];
+	}
+
+	if (stage_load(&stages, stage_file) == -1) {
+		exit(EXIT_FAILURE);
+	}
+
+	// One instance drives the LEDs, simulations drive none
+	if (sim_script == NULL && lock_instance() == -1) {
+		exit(EXIT_FAILURE);
+	}
+
+	// A simulation brings its own LEDs and backend
+	if (sim_script != NULL) {
+		const char *file = argc - optind == 2 ? monitor_file : NULL;
+		led_count = sim_load(sim_script, &file, leds);
+		if (led_count <= 0) {
+			exit(EXIT_FAILURE);
+		}
+		monitor_file = file;
+		backend = sim_pwm ? &backend_sim_pwm : &backend_sim;
+		matrix_spec = i2c_spec = ws2812_spec = NULL;
 	}
 
-	// Get GPIO pin from fw_printenv and set off state
-	gpio_pin = get_gpio_pin_from_fw();
-	if (gpio_pin == -1) {
+	// A matrix is scanned by its own driver on top of the chardev lines, or
+	// the registers when mmio was asked for
+	const struct line_ops *matrix_lines = backend == &backend_mmio ? &lines_mmio : &lines_chardev;
+	if (matrix_spec != NULL) {
+		backend = &backend_matrix;
+	} else if (i2c_spec != NULL) {
+		backend = &backend_i2c;
+	} else if (ws2812_spec != NULL) {
+		backend = &backend_ws2812;
+	}
+
+	// Pick the animation frame rate the backend can afford: PWM backends
+	// take levels directly, software PWM costs a write per edge so frames
+	// are capped, plain on/off outputs only take keyframes
+	if (soft_pwm && !(backend->caps & LED_CAP_SOFT_PWM)) {
+		fprintf(stderr, "The %s backend is too slow for software PWM\n", backend->name);
+		exit(EXIT_FAILURE);
+	}
+	if (backend->caps & LED_CAP_PWM) {
+		soft_pwm = 0;
+		frame_ms = backend->frame_ms;
+	} else if (soft_pwm) {
+		frame_ms = SOFT_PWM_FRAME_MS;
+	}
+
+	// Get the LED GPIOs from fw_printenv, or the cells of the matrix
+	if (matrix_spec != NULL) {
+		if (matrix_parse(&led_matrix, matrix_spec) == -1) {
+			fprintf(stderr, "Invalid matrix: %s\n", matrix_spec);
+			exit(EXIT_FAILURE);
+		}
+		led_matrix.ops = matrix_lines;
+		led_count = matrix_leds(&led_matrix, leds);
+	} else if (i2c_spec != NULL) {
+		led_count = i2c_parse(i2c_spec, leds);
+		if (led_count <= 0) {
+			fprintf(stderr, "Invalid I2C controller: %s\n", i2c_spec);
+			exit(EXIT_FAILURE);
+		}
+	} else if (ws2812_spec != NULL) {
+		led_count = ws2812_parse(ws2812_spec, leds);
+		if (led_count <= 0) {
+			fprintf(stderr, "Invalid WS2812 strip: %s\n", ws2812_spec);
+			exit(EXIT_FAILURE);
+		}
+	} else if (sim_script == NULL) {
+		led_count = discover_leds();
+	}
+	if (led_count == 0) {
 		fprintf(stderr, "Failed to retrieve GPIO pin from fw_printenv\n");
+		diag_log(DIAG_NO_LEDS);
 		exit(EXIT_FAILURE);
 	}
 
-	// Export the GPIO using system command
-	if (export_gpio(gpio_pin) == -1) {
-		fprintf(stderr, "Failed to export GPIO %d\n", gpio_pin);
+	// Claim the GPIOs through the selected backend, before anything refers
+	// to LEDs by index since the ones that fail are dropped. Lazily claimed
+	// lines are taken as a set when they are first lit.
+	if (lazy_claim && backend != &backend_sysfs && backend != &backend_chardev &&
+	    backend != &backend_mmio) {
+		fprintf(stderr, "The %s backend cannot claim lazily\n", backend->name);
+		exit(EXIT_FAILURE);
+	}
+	if (lazy_claim) {
+		syslog(LOG_INFO, "Claiming %d GPIOs when first lit", led_count);
+	} else if (claim_leds() == -1) {
+		fprintf(stderr, "Failed to open GPIOs with the %s backend\n", backend->name);
+		diag_log(DIAG_CLAIM);
+		exit(EXIT_FAILURE);
+	}
+	// Full color pixels take the status color themselves
+	if (backend->caps & LED_CAP_RGB) {
+		if (status_color != -1) {
+			color_pixels(status_color);
+		}
+	} else if (group_init_rgb(&rgb_group, leds, led_count, frame_ms != 0) == -1 &&
+	           status_color != -1) {
+		fprintf(stderr, "No gpio_led_r/g/b entries, ignoring color\n");
+		status_color = -1;
+	}
+	if (strip_spec != NULL && resolve_strip(strip_spec) == -1) {
 		exit(EXIT_FAILURE);
 	}
 
-	// Set the initial state of the GPIO to "off" based on the active_low flag
-	set_gpio_value(gpio_pin, off_value);
+	// A pixel strip is a strip in its own order unless told otherwise
+	if (strip_spec == NULL && ws2812_spec != NULL) {
+		for (strip_count = 0; strip_count < led_count; strip_count++) {
+			strip[strip_count] = strip_count;
+		}
+	}
 
-	init_daemon();
+	// The button is optional, boards without one simply don't have the entry
+	if (button.gpio == -1 && sim_script == NULL) {
+		button.gpio = get_button_from_fw(&button.active_low);
+	}
+
+	// Set the initial state of the GPIOs to "off" based on the active_low flag
+	reset_gpio_state();
+
+	// A supervisor passing sockets tracks our pid, so stay in the foreground
+	if (sim_script == NULL && listen_fd_count == 0) {
+		init_daemon();
+	}
+	write_pid();
 	setup_signal_handling();
 
-	// Open syslog connection
-	openlog("led_blink_daemon", LOG_PID, LOG_DAEMON);
+	// Open syslog connection, simulations also log to stderr
+	openlog("led_blink_daemon", LOG_PID | (sim_active ? LOG_PERROR : 0), LOG_DAEMON);
+
+	if (button.gpio != -1 && button_open(&button) == -1) {
+		syslog(LOG_WARNING, "Button on GPIO %d unavailable, continuing without it", button.gpio);
+	}
+
+	if (trace_file != NULL || trace_ftrace) {
+		trace_open(trace_ftrace);
+	}
+
+	if (metrics_addr != NULL) {
+		metrics_init(backend, leds, &led_count);
+		if (http_listen(&metrics_server, metrics_addr, metrics_handler) == -1) {
+			syslog(LOG_ERR, "Failed to serve metrics on %s", metrics_addr);
+		}
+	}
+	if (control_addr != NULL &&
+	    http_listen(&control_server, control_addr, control_handler) == -1) {
+		syslog(LOG_ERR, "Failed to serve control on %s", control_addr);
+	}
+	adopt_sockets();
+	if (identify_addr != NULL) {
+		identify_fd = identify_open(identify_addr, identify_key);
+		if (identify_fd < 0) {
+			syslog(LOG_ERR, "Failed to listen for identify on %s", identify_addr);
+		}
+	}
+
+	// Beacons replace the wall clock, the leader's own clock is the timeline
+	if (beacon_spec != NULL) {
+		beacon_fd = beacon_open(beacon_spec);
+		if (beacon_fd < 0) {
+			syslog(LOG_ERR, "Phase beacons unavailable, blinking unaligned");
+		}
+	} else if (clock_sync) {
+		clock_offset = wall_offset();
+		clock_fd = clock_open();
+		if (clock_fd < 0) {
+			syslog(LOG_WARNING, "Cannot watch for clock changes: %s", strerror(errno));
+		}
+	}
+
+	// Without inotify the file is polled
+	watch_fd = watch_open();
+	if (watch_fd < 0) {
+		syslog(LOG_WARNING, "Cannot watch %s, polling it instead", monitor_file);
+	}
+
+	if (handover[0] != '\0') {
+		apply_handover(now_ms());
+	}
+
+	run_loop();
+
+	button_close(&button);
+	if (!leave_leds) {
+		reset_gpio_state();  // Ensure LEDs are "off" before exiting
+		release_leds();
+	}
+	log_stats();
+	if (trace_file != NULL) {
+		trace_export(trace_file);
+	}
+	trace_close();
+	for (int i = 0; i < SERVER_COUNT; i++) {
+		http_close(servers[i]);
+	}
+	identify_close();
+	if (clock_fd >= 0) {
+		close(clock_fd);
+	}
+	beacon_close();
+	if (watch_fd >= 0) {
+		close(watch_fd);
+	}
+	closelog();
+	if (sim_active) {
+		sim_finish();
+	}
+	return EXIT_SUCCESS;
+}
+
+uint64_t now_ms(void) {
+	if (sim_active) {
+		return sim_now;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint64_t earliest(uint64_t a, uint64_t b) {
+	if (a == 0) {
+		return b;
+	}
+	if (b == 0) {
+		return a;
+	}
+	return a < b ? a : b;
+}
+
+static void run_loop(void) {
+	uint64_t next_file_check = now_ms();  // Checked once at start, then polled without inotify
+	uint64_t next_resync = resync_ms ? now_ms() + resync_ms : 0;
+	uint64_t idle_since = 0;  // Start of the current stretch with nothing to do
+	uint64_t dark_since = 0;  // Start of the current stretch with every LED off
 
 	while (keep_running) {
-		// Check if the monitored file exists
-		if (access(monitor_file, F_OK) == 0) {
-			if (!file_was_present) {
-				// The file has just appeared, so start blinking
-				syslog(LOG_INFO, "Monitored file appeared, starting LED blink");
-				double new_interval = read_blink_interval_from_file(monitor_file);
-				if (new_interval > 0) {
-					blink_interval = new_interval;
-					syslog(LOG_INFO, "Blink interval updated to %.2f seconds", blink_interval);
+		uint64_t now = now_ms();
+
+		if (pending_diag != -1) {
+			diag_raise((enum diag)pending_diag, now);
+			pending_diag = -1;
+		}
+
+		if (next_file_check && now >= next_file_check) {
+			uint64_t start = trace_now();
+			settle_file_events(now);
+			trace_dispatch("file", start);
+			next_file_check = watch_fd < 0 ? now + FILE_POLL_MS : 0;
+		}
+		if (next_resync && now >= next_resync) {
+			for (int i = 0; i < led_count; i++) {
+				leds[i].shadow_valid = 0;
+			}
+			led_stats.resyncs++;
+			update_leds(now, 1);
+			next_resync = now + resync_ms;
+		}
+		update_leds(now, 0);
+		if (button.fd >= 0) {
+			button_handle_timeout(&button, now);
+		}
+		if (backend == &backend_matrix) {
+			matrix_service(&led_matrix, now);
+		}
+		uint64_t next_beacon = beacon_service(now);
+
+		// Lines dark long enough are handed back until something lights up
+		uint64_t next_release = 0;
+		if (release_ms && leds_claimed && leds_dark()) {
+			if (dark_since == 0) {
+				dark_since = now;
+			}
+			if (now >= dark_since + release_ms) {
+				release_leds();
+				syslog(LOG_INFO, "Released the GPIOs after %u s dark",
+				       (unsigned int)(release_ms / 1000));
+			} else {
+				next_release = dark_since + release_ms;
+			}
+		} else {
+			dark_since = 0;
+		}
+
+		// Sleep until the next deadline, the button has edges queued, the
+		// monitored file's directory changed, a datagram arrived or the
+		// wall clock was set or a phase beacon is due
+		uint64_t deadline = earliest(next_file_check, leds_next_edge());
+		deadline = earliest(deadline, next_resync);
+		if (backend == &backend_matrix) {
+			deadline = earliest(deadline, matrix_next_deadline(&led_matrix));
+		}
+		deadline = earliest(deadline, button_next_deadline(&button));
+		deadline = earliest(deadline, next_beacon);
+		deadline = earliest(deadline, next_release);
+		for (int i = 0; i < SERVER_COUNT; i++) {
+			deadline = earliest(deadline, http_next_deadline(servers[i]));
+		}
+
+		// Nothing blinking, scheduled or connected, and nothing that only a
+		// running daemon would notice: the supervisor can relaunch us
+		if (idle_exit_ms && deadline == 0 && stages.states[stage].spec[0] == '\0' && button.fd < 0 &&
+		    identify_fd < 0 && beacon_fd < 0) {
+			if (idle_since == 0) {
+				idle_since = now;
+			}
+			if (now >= idle_since + idle_exit_ms) {
+				// Releasing the lines could change them, exiting leaves them be
+				syslog(LOG_INFO, "Idle for %u s, exiting", (unsigned int)(idle_exit_ms / 1000));
+				leave_leds = 1;
+				break;
+			}
+			deadline = idle_since + idle_exit_ms;
+		} else {
+			idle_since = 0;
+		}
+		int timeout = deadline == 0 ? -1 : deadline > now ? (int)(deadline - now) : 0;
+
+		struct pollfd pfds[5 + SERVER_COUNT * (1 + HTTP_MAX_CONN)] = {
+			{ .fd = button.fd, .events = POLLIN },
+			{ .fd = watch_fd, .events = POLLIN },
+			{ .fd = identify_fd, .events = POLLIN },
+			{ .fd = clock_fd, .events = POLLIN },
+			{ .fd = beacon_fd, .events = POLLIN },
+		};
+		int server_pfd[SERVER_COUNT];
+		int npfds = 5;
+		for (int i = 0; i < SERVER_COUNT; i++) {
+			server_pfd[i] = npfds;
+			npfds += http_pollfds(servers[i], &pfds[npfds]);
+		}
+		if (sim_active) {
+			sim_sleep(deadline);
+			timeout = 0;
+		}
+		int ready = poll(pfds, (nfds_t)npfds, timeout);
+		if (ready > 0) {
+			idle_since = 0;
+			if (pfds[0].revents & POLLIN) {
+				uint64_t start = trace_now();
+				trace_wakeup("button");
+				button_handle_events(&button, now_ms());
+				trace_dispatch("button", start);
+			}
+			if (pfds[1].revents & POLLIN) {
+				uint64_t start = trace_now();
+				trace_wakeup("file");
+				unsigned long count = 0;
+				int ev = watch_read(&count);
+				if (ev) {
+					led_stats.file_events += count;
+					file_pending |= ev;
+					file_pending_count += count;
+					if (coalesce_ms == 0) {
+						settle_file_events(now_ms());
+					} else if (next_file_check == 0) {
+						next_file_check = now_ms() + coalesce_ms;
+					}
+				}
+				trace_dispatch("file", start);
+			}
+			if (pfds[2].revents & POLLIN) {
+				struct identify_cmd cmd;
+				uint64_t start = trace_now();
+				trace_wakeup("identify");
+				if (identify_read(&cmd, now_ms()) == 1) {
+					identify_apply(&cmd, now_ms());
+				}
+				trace_dispatch("identify", start);
+			}
+			if (pfds[3].revents & POLLIN) {
+				uint64_t start = trace_now();
+				trace_wakeup("clock");
+				clock_changed(now_ms());
+				trace_dispatch("clock", start);
+			}
+			if (pfds[4].revents & POLLIN) {
+				int64_t offset;
+				uint64_t start = trace_now();
+				trace_wakeup("beacon");
+				if (beacon_read(now_ms(), &offset)) {
+					clock_adjust(offset, now_ms());
 				}
-				blink_led(gpio_pin);  // Start blinking the LED
-				file_was_present = 1;  // Mark that the file is present
-				gpio_was_active = 1;   // Mark that the GPIO is active
+				trace_dispatch("beacon", start);
 			}
 		} else {
-			if (file_was_present) {
-				// The file has just disappeared, so set the GPIO to the off state
-				syslog(LOG_INFO, "Monitored file disappeared, turning off GPIO");
-				set_gpio_value(gpio_pin, off_value);  // Set GPIO to "off"
-				file_was_present = 0;  // Mark that the file is no longer present
-				gpio_was_active = 0;   // Mark that the GPIO is inactive
+			trace_wakeup(ready == 0 ? "timer" : "signal");
+			if (ready == 0 && deadline != 0) {
+				uint64_t woke = now_ms();
+				histogram_observe(&led_stats.late_ms, woke > deadline ? (uint32_t)(woke - deadline) : 0);
 			}
-			usleep(100000);  // Sleep for 500ms before checking again
+		}
+
+		// Requests, new connections and expiry of idle ones
+		for (int i = 0; i < SERVER_COUNT; i++) {
+			if (ready < 0) {
+				break;
+			}
+			uint64_t start = trace_now();
+			http_service(servers[i], &pfds[server_pfd[i]], now_ms());
+			if (servers[i]->fd >= 0 && ready > 0) {
+				trace_dispatch(servers[i] == &metrics_server ? "metrics" : "control", start);
+			}
+		}
+		led_stats.wakeups++;
+
+		if (stats_requested) {
+			stats_requested = 0;
+			log_stats();
+			if (trace_file != NULL) {
+				trace_export(trace_file);
+			}
+		}
+
+		// Reap finished button actions
+		while (waitpid(-1, NULL, WNOHANG) > 0) {
 		}
 	}
+}
 
-	set_gpio_value(gpio_pin, off_value);  // Ensure LED is "off" before exiting
-	unexport_gpio(gpio_pin);
-	closelog();
-	return EXIT_SUCCESS;
+// Feed the monitored file's presence to the state machine. With reread the
+// file was written to, so a "file" state takes its settings up again.
+static void check_monitored_file(uint64_t now, int reread) {
+	if (access(monitor_file, F_OK) == 0) {
+		stage_event(reread ? STAGE_CHANGED : STAGE_PRESENT, now);
+	} else {
+		stage_event(STAGE_ABSENT, now);
+	}
 }
 
-static void blink_led(int gpio_pin) {
-	unsigned int sleep_time = (unsigned int)(blink_interval * 1000000);
+// Move to the state the event leads to, if any. Guards need the first word
+// of the monitored file, which is only read for them.
+static void stage_event(enum stage_event ev, uint64_t now) {
+	char word[STAGE_NAME_MAX] = "";
 
-	while (keep_running) {
-		// Check if the file still exists before each blink cycle
-		if (access(monitor_file, F_OK) != 0) {
-			break;  // Stop blinking if the file is no longer accessible
+	if (stages.guarded) {
+		FILE *fp = fopen(monitor_file, "r");
+		if (fp != NULL) {
+			if (fscanf(fp, "%15s", word) != 1) {
+				word[0] = '\0';
+			}
+			fclose(fp);
+		}
+	}
+	int next = stage_next(&stages, stage, ev, word);
+	if (next != -1) {
+		syslog(LOG_INFO, "Stage %s, %s: %s", stages.states[stage].name, stage_event_name(ev),
+		       stages.states[next].name);
+		enter_stage(next, now);
+	}
+}
+
+// Show what the state asks for on the status LED, entering a state again
+// restarts it
+static void enter_stage(int next, uint64_t now) {
+	const struct stage_state *st = &stages.states[next];
+	int from_file = strcmp(st->spec, "file") == 0;
+
+	stage = next;
+	if (st->spec[0] == '\0') {
+		hide_pattern(LAYER_ID_BOOT);
+		update_leds(now, 1);
+		return;
+	}
+	if (st->color != -1) {
+		set_status_color(st->color);
+	}
+	if (from_file) {
+		int color = -1;
+		double new_interval = read_blink_interval_from_file(monitor_file, &color,
+		                                                    boot_pattern, sizeof(boot_pattern));
+		if (new_interval > 0) {
+			blink_interval = new_interval;
+			syslog(LOG_INFO, "Blink interval updated to %.2f seconds", blink_interval);
 		}
+		if (color != -1) {
+			set_status_color(color);
+		}
+	}
+	blink_led(from_file ? boot_pattern : st->spec,
+	          st->half_ms ? st->half_ms : (uint32_t)(blink_interval * 1000), now);
+}
 
-		set_gpio_value(gpio_pin, 1 - off_value);  // Set GPIO to "on"
-		usleep(sleep_time);
-		set_gpio_value(gpio_pin, off_value);  // Set GPIO to "off"
-		usleep(sleep_time);
+// Act once on the file events collected since the first of a burst, a
+// script replacing the file in steps only shows its final state
+static void settle_file_events(uint64_t now) {
+	check_monitored_file(now, file_pending & IN_CLOSE_WRITE);
+	if (file_pending_count > 1) {
+		led_stats.file_coalesced += file_pending_count - 1;
 	}
+	file_pending = 0;
+	file_pending_count = 0;
 }
 
-static int export_gpio(int gpio) {
-	char command[MAX_BUF];
-	snprintf(command, sizeof(command), "gpio export %d", gpio);
-	snprintf(command, sizeof(command), "gpio output %d", gpio);
-	return system(command);
+// Put a pattern on the status LEDs. With a color each channel of the RGB
+// group gets the pattern scaled to its level from the color table, channels
+// that are off still get a layer so the color is not mixed with whatever is
+// underneath.
+static void show_pattern(int id, enum layer_prio prio, const struct pattern *p,
+                         uint64_t now, uint32_t duration_ms) {
+	if (rgb_group.count == 0 || (status_color == -1 && !pattern_colored(p))) {
+		layer_push(&leds[0].layers, id, prio, p, now, duration_ms);
+		sync_pattern(id, prio, now);
+		return;
+	}
+
+	int color = status_color != -1 ? status_color : color_lookup("white");
+	for (int c = 0; c < GROUP_MAX_CHANNELS; c++) {
+		int m = rgb_group.members[c];
+		if (m == -1) {
+			continue;
+		}
+		struct pattern channel;
+		group_pattern(&channel, p, &rgb_group, c, color);
+		layer_push(&leds[m].layers, id, prio, &channel, now, duration_ms);
+	}
+	sync_pattern(id, prio, now);
 }
 
-static int unexport_gpio(int gpio) {
-	char command[MAX_BUF];
-	snprintf(command, sizeof(command), "gpio unexport %d", gpio);
-	return system(command);
+// Status patterns follow the wall clock with -S, alerts start right away
+static void sync_pattern(int id, enum layer_prio prio, uint64_t now) {
+	if (!clock_sync || prio == LAYER_ALERT) {
+		return;
+	}
+	for (int i = 0; i < led_count; i++) {
+		layer_sync(&leds[i].layers, id, (uint64_t)((int64_t)now + clock_offset));
+	}
 }
 
-static int set_gpio_value(int gpio, int value) {
-	char buf[MAX_BUF];
-	snprintf(buf, sizeof(buf), "/sys/class/gpio/gpio%d/value", gpio);
-	FILE *fd = fopen(buf, "w");
-	if (fd == NULL) {
-		syslog(LOG_ERR, "Failed to open GPIO value for GPIO %d", gpio);
+static int64_t wall_offset(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 - (int64_t)now_ms();
+}
+
+// A CLOCK_REALTIME timer far in the future, TFD_TIMER_CANCEL_ON_SET makes it
+// readable as soon as anything steps the clock. NTP slewing moves the
+// monotonic clock along with it, so only steps change the offset.
+static int clock_open(void) {
+	struct itimerspec its = { .it_value = { .tv_sec = INT_MAX } };
+	int fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	if (timerfd_settime(fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// The wall clock was set, ease the synced patterns onto the new phase
+static void clock_changed(uint64_t now) {
+	struct itimerspec its = { .it_value = { .tv_sec = INT_MAX } };
+	uint64_t expirations;
+
+	if (read(clock_fd, &expirations, sizeof(expirations)) < 0 && errno != ECANCELED) {
+		return;
+	}
+	timerfd_settime(clock_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL);
+
+	int64_t offset = wall_offset();
+	if (offset != clock_offset) {
+		syslog(LOG_INFO, "Wall clock stepped by %lld ms, realigning",
+		       (long long)(offset - clock_offset));
+		clock_adjust(offset, now);
+	}
+}
+
+// Move the timeline synced patterns follow, they ease onto the new phase
+static void clock_adjust(int64_t offset, uint64_t now) {
+	int64_t delta = offset - clock_offset;
+
+	clock_offset = offset;
+	if (delta == 0) {
+		return;
+	}
+	for (int i = 0; i < led_count; i++) {
+		layer_retime(&leds[i].layers, delta);
+	}
+	update_leds(now, 1);
+}
+
+static void hide_pattern(int id) {
+	for (int i = 0; i < led_count; i++) {
+		layer_pop(&leds[i].layers, id);
+	}
+}
+
+static void set_status_color(int color) {
+	if (backend->caps & LED_CAP_RGB) {
+		color_pixels(color);
+	} else if (rgb_group.count == 0) {
+		return;
+	}
+	status_color = color;
+	syslog(LOG_INFO, "Status color set to %s", color_name(color));
+}
+
+// Show a pattern spec (builtin, keyframes or strip choreography) in place of
+// any earlier layer with the same id. Returns -1 if the spec is invalid.
+static int show_spec(int id, enum layer_prio prio, const char *spec, uint32_t half_ms,
+                     uint64_t now, uint32_t duration_ms) {
+	struct pattern p;
+
+	// Strip choreographies push one pattern per member, all with the same
+	// epoch so they stay phase-locked
+	int choreo = choreo_lookup(spec);
+	if (choreo != -1 && strip_count > 0) {
+		hide_pattern(id);
+		for (int i = 0; i < strip_count; i++) {
+			choreo_pattern(&p, (enum choreo)choreo, i, strip_count, half_ms);
+			layer_push(&leds[strip[i]].layers, id, prio, &p, now, duration_ms);
+		}
+		sync_pattern(id, prio, now);
+		update_leds(now, 1);
+		return 0;
+	}
+
+	if (pattern_parse(spec, half_ms, &p) == -1) {
+		return -1;
+	}
+	hide_pattern(id);
+	show_pattern(id, prio, &p, now, duration_ms);
+	update_leds(now, 1);
+	return 0;
+}
+
+static void blink_led(const char *spec, uint32_t half, uint64_t now) {
+	if (show_spec(LAYER_ID_BOOT, LAYER_BASE, spec, half, now, 0) == -1) {
+		struct pattern p;
+		syslog(LOG_ERR, "Invalid pattern %s, blinking instead", spec);
+		pattern_blink(&p, half, half);
+		hide_pattern(LAYER_ID_BOOT);
+		show_pattern(LAYER_ID_BOOT, LAYER_BASE, &p, now, 0);
+		update_leds(now, 1);
+	}
+}
+
+// HTTP control for the web UI. Parameters come from the query string or a
+// form encoded POST body:
+//   /state                              current state as JSON
+//   /pattern?pattern=&interval=&color=&duration=
+//                                       show a pattern over the boot status,
+//                                       for duration ms or until cleared
+//   /clear                              remove it
+//   /readout?text=&mode=&repeat=        spell out text, or "ip" for the
+//                                       address, as blink codes or Morse
+//   /takeover                           POST only, from this machine, hand
+//                                       the state to a new instance and exit
+static void control_handler(const struct http_request *req, struct http_response *resp) {
+	static char body[PATTERN_SPEC_MAX * 2 + 160];
+	const char *params = strcmp(req->method, "POST") == 0 ? req->body : req->query;
+	uint64_t now = now_ms();
+
+	if (strcmp(req->method, "GET") != 0 && strcmp(req->method, "POST") != 0) {
+		resp->status = 405;
+		return;
+	}
+
+	if (strcmp(req->path, "/pattern") == 0) {
+		char spec[PATTERN_SPEC_MAX], value[MAX_BUF];
+		unsigned int duration = 0;
+		double interval = blink_interval;
+		int color = -1;
+
+		if (http_param(params, "pattern", spec, sizeof(spec)) == -1) {
+			resp->status = 400;
+			return;
+		}
+		if (http_param(params, "interval", value, sizeof(value)) == 0) {
+			char *end;
+			interval = strtod(value, &end);
+			if (*end != '\0' || interval <= 0 || interval > 3600) {
+				resp->status = 400;
+				return;
+			}
+		}
+		if ((http_param(params, "color", value, sizeof(value)) == 0 &&
+		     (color = color_lookup(value)) == -1) ||
+		    (http_param(params, "duration", value, sizeof(value)) == 0 &&
+		     parse_ms(value, &duration) == -1) ||
+		    !pattern_valid(spec)) {
+			resp->status = 400;
+			return;
+		}
+		if (color != -1) {
+			set_status_color(color);
+		}
+		show_spec(LAYER_ID_CONTROL, LAYER_STATUS, spec, (uint32_t)(interval * 1000), now, duration);
+		snprintf(control_spec, sizeof(control_spec), "%s", spec);
+		control_expires = duration ? now + duration : 0;
+		control_half_ms = (uint32_t)(interval * 1000);
+		syslog(LOG_INFO, "Control pattern %s", spec);
+	} else if (strcmp(req->path, "/readout") == 0) {
+		char text[MAX_BUF], value[MAX_BUF];
+		enum readout_mode mode = READOUT_BLINK;
+		int repeat = READOUT_REPEAT;
+
+		if (http_param(params, "text", text, sizeof(text)) == -1) {
+			resp->status = 400;
+			return;
+		}
+		if (http_param(params, "mode", value, sizeof(value)) == 0) {
+			if (strcmp(value, "morse") == 0) {
+				mode = READOUT_MORSE;
+			} else if (strcmp(value, "blink") != 0) {
+				resp->status = 400;
+				return;
+			}
+		}
+		if (http_param(params, "repeat", value, sizeof(value)) == 0) {
+			repeat = atoi(value);
+		}
+		if (strcmp(text, "ip") == 0 && local_ip(text, sizeof(text)) == -1) {
+			resp->status = 404;
+			return;
+		}
+		if (repeat < 1 || repeat > 10 || show_readout(text, mode, repeat, now) == -1) {
+			resp->status = 400;
+			return;
+		}
+	} else if (strcmp(req->path, "/takeover") == 0) {
+		// The new instance waits for our lock, which goes with the process.
+		// It runs on this machine, so nobody else gets to stop us.
+		if (strcmp(req->method, "POST") != 0) {
+			resp->status = 405;
+			return;
+		}
+		if (!req->local) {
+			resp->status = 403;
+			return;
+		}
+		if (control_expires != 0 && now >= control_expires) {
+			control_spec[0] = '\0';
+		}
+		resp->status = 200;
+		resp->body = body;
+		resp->len = snprintf(body, sizeof(body), "color=%s&control=%s&interval=%u&remaining=%u",
+		                     status_color != -1 ? color_name(status_color) : "", control_spec,
+		                     (unsigned int)control_half_ms,
+		                     control_expires ? (unsigned int)(control_expires - now) : 0);
+		syslog(LOG_INFO, "Handing over to a new instance");
+		leave_leds = 1;
+		keep_running = 0;
+		return;
+	} else if (strcmp(req->path, "/clear") == 0) {
+		hide_pattern(LAYER_ID_CONTROL);
+		update_leds(now, 1);
+		control_spec[0] = '\0';
+	} else if (strcmp(req->path, "/state") != 0) {
+		resp->status = 404;
+		return;
+	}
+
+	if (control_expires != 0 && now >= control_expires) {
+		control_spec[0] = '\0';
+	}
+	resp->status = 200;
+	resp->type = "application/json";
+	resp->body = body;
+	resp->len = snprintf(body, sizeof(body),
+	                     "{\"file\":%s,\"stage\":\"%s\",\"pattern\":\"%s\",\"interval\":%.3f,\"color\":\"%s\","
+	                     "\"control\":\"%s\",\"leds\":%d}\n",
+	                     access(monitor_file, F_OK) == 0 ? "true" : "false", stages.states[stage].name,
+	                     boot_pattern, blink_interval,
+	                     status_color != -1 ? color_name(status_color) : "", control_spec, led_count);
+	if (resp->len >= (int)sizeof(body)) {
+		resp->len = (int)sizeof(body) - 1;
+	}
+}
+
+// Overlay from an authenticated identify datagram, above everything else
+// until it expires
+static void identify_apply(const struct identify_cmd *cmd, uint64_t now) {
+	uint32_t duration = cmd->duration_ms ? cmd->duration_ms : IDENTIFY_SHOW_MS;
+	const char *spec = cmd->identify ? "blink" : cmd->spec;
+	uint32_t half = cmd->identify ? IDENTIFY_BLINK_MS : (uint32_t)(blink_interval * 1000);
+
+	if (show_spec(LAYER_ID_IDENTIFY, LAYER_ALERT, spec, half, now, duration) == -1) {
+		syslog(LOG_WARNING, "Invalid identify pattern %s", spec);
+		return;
+	}
+	syslog(LOG_INFO, "Identify %s for %u ms", spec, (unsigned int)duration);
+}
+
+// Play text as an alert overlay, repeated and then gone. The steps are
+// compiled once and the layers only point at them.
+static int show_readout(const char *text, enum readout_mode mode, int repeat, uint64_t now) {
+	struct pattern p;
+	uint32_t unit = mode == READOUT_MORSE ? READOUT_MORSE_MS : READOUT_BLINK_MS;
+
+	hide_pattern(LAYER_ID_READOUT);
+	if (pattern_readout(&p, readout_steps, READOUT_MAX_STEPS, text, mode, unit) == -1) {
+		syslog(LOG_WARNING, "Cannot read out %s", text);
+		return -1;
+	}
+
+	// Color groups cannot scale a shared step list, every channel shows it
+	if (rgb_group.count == 0) {
+		layer_push(&leds[0].layers, LAYER_ID_READOUT, LAYER_ALERT, &p, now, p.period * (uint32_t)repeat);
+	}
+	for (int c = 0; c < GROUP_MAX_CHANNELS && rgb_group.count > 0; c++) {
+		if (rgb_group.members[c] != -1) {
+			layer_push(&leds[rgb_group.members[c]].layers, LAYER_ID_READOUT, LAYER_ALERT, &p, now,
+			           p.period * (uint32_t)repeat);
+		}
+	}
+	update_leds(now, 1);
+	syslog(LOG_INFO, "Reading out %s, %u ms", text, (unsigned int)(p.period * (uint32_t)repeat));
+	return 0;
+}
+
+// Claim every LED, or failing that each one alone, keeping those that work
+static int claim_leds(void) {
+	if (backend->open(leds, led_count) == 0) {
+		leds_claimed = 1;
+		return 0;
+	}
+	if (backend != &backend_sysfs && backend != &backend_chardev && backend != &backend_mmio) {
+		return -1;
+	}
+
+	int count = 0;
+	for (int i = 0; i < led_count; i++) {
+		if (backend->open(&leds[i], 1) == -1) {
+			syslog(LOG_ERR, "Dropping LED %s on GPIO %d", leds[i].name, leds[i].gpio);
+			continue;
+		}
+		backend->close(&leds[i], 1);
+		leds[count++] = leds[i];
+	}
+	if (count == 0 || backend->open(leds, count) == -1) {
 		return -1;
 	}
-	fprintf(fd, "%d", value);
-	fclose(fd);
+	led_count = count;
+	leds_claimed = 1;
+	pending_diag = DIAG_CLAIM;
 	return 0;
 }
 
-static int get_gpio_pin_from_fw(void) {
+// Claim the lines of a lazily claimed set as they are about to be lit. Too
+// late to drop LEDs, a failure is retried by the next write.
+static int acquire_leds(void) {
+	if (backend->open(leds, led_count) == -1) {
+		syslog(LOG_ERR, "Failed to claim the GPIOs with the %s backend", backend->name);
+		return -1;
+	}
+	for (int i = 0; i < led_count; i++) {
+		leds[i].shadow_valid = 0;
+	}
+	leds_claimed = 1;
+	syslog(LOG_INFO, "Claimed %d GPIOs", led_count);
+	return 0;
+}
+
+// Give the lines back, to other tools while idle or for good on exit
+static void release_leds(void) {
+	if (!leds_claimed) {
+		return;
+	}
+	backend->close(leds, led_count);
+	for (int i = 0; i < led_count; i++) {
+		leds[i].shadow_valid = 0;
+	}
+	leds_claimed = 0;
+}
+
+// Every line written off and nothing scheduled to change that
+static int leds_dark(void) {
+	for (int i = 0; i < led_count; i++) {
+		if (leds[i].next_edge != 0 || !leds[i].shadow_valid || leds[i].shadow != LEVEL_OFF) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Report a failure in syslog and the kernel log, which is all a failure
+// the daemon exits on gets: there are no claimed LEDs left to blink on
+static void diag_log(enum diag d) {
+	syslog(LOG_ERR, "Error %d: %s", diag_classes[d].code, diag_classes[d].what);
+	int fd = open("/dev/kmsg", O_WRONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		dprintf(fd, "<3>ledd: error %d: %s\n", diag_classes[d].code, diag_classes[d].what);
+		close(fd);
+	}
+}
+
+// Report a failure the daemon carries on after, and blink its code over
+// everything else on every LED, one of them will work
+static void diag_raise(enum diag d, uint64_t now) {
+	char text[4];
+	struct pattern p;
+
+	diag_log(d);
+	snprintf(text, sizeof(text), "%d", diag_classes[d].code);
+	if (led_count == 0 ||
+	    pattern_readout(&p, diag_steps, (int)(sizeof(diag_steps) / sizeof(diag_steps[0])), text,
+	                    READOUT_BLINK, READOUT_BLINK_MS) == -1) {
+		return;
+	}
+	for (int i = 0; i < led_count; i++) {
+		layer_push(&leds[i].layers, LAYER_ID_DIAG, LAYER_ALERT, &p, now, p.period * DIAG_REPEAT);
+	}
+	update_leds(now, 1);
+}
+
+// First IPv4 address of an interface that is up, loopback aside
+static int local_ip(char *buf, size_t len) {
+	struct ifaddrs *ifa, *list;
+	int ret = -1;
+
+	if (getifaddrs(&list) < 0) {
+		return -1;
+	}
+	for (ifa = list; ifa != NULL && ret == -1; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_INET ||
+		    !(ifa->ifa_flags & IFF_UP) || (ifa->ifa_flags & IFF_LOOPBACK)) {
+			continue;
+		}
+		const struct sockaddr_in *sin = (const struct sockaddr_in *)ifa->ifa_addr;
+		if (inet_ntop(AF_INET, &sin->sin_addr, buf, (socklen_t)len) != NULL) {
+			ret = 0;
+		}
+	}
+	freeifaddrs(list);
+	return ret;
+}
+
+// On/off output for a brightness under software PWM, and when it flips
+static uint8_t soft_pwm_level(uint8_t brightness, uint64_t now, uint64_t *next) {
+	uint32_t on_ms = (brightness * SOFT_PWM_PERIOD_MS + LEVEL_ON / 2) / LEVEL_ON;
+
+	*next = 0;
+	if (on_ms == 0) {
+		return LEVEL_OFF;
+	}
+	if (on_ms >= SOFT_PWM_PERIOD_MS) {
+		return LEVEL_ON;
+	}
+
+	uint64_t start = now - now % SOFT_PWM_PERIOD_MS;
+	if (now - start < on_ms) {
+		*next = start + on_ms;
+		return LEVEL_ON;
+	}
+	*next = start + SOFT_PWM_PERIOD_MS;
+	return LEVEL_OFF;
+}
+
+// Re-evaluate the LEDs whose next edge is due (or all of them after a layer
+// change) and hand everything that changed to the backend in one write.
+// LEDs running patterns from a shared epoch have identical deadlines, so
+// they are all handled by the same wakeup and land in the same write.
+static void update_leds(uint64_t now, int all) {
+	int due = 0;
+
+	for (int i = 0; i < led_count; i++) {
+		struct led *led = &leds[i];
+		int frame = all || (led->next_frame && now >= led->next_frame);
+		if (!frame && (led->next_edge == 0 || now < led->next_edge)) {
+			continue;
+		}
+
+		if (frame) {
+			led->brightness = layer_eval(&led->layers, now, frame_ms, fade_ms, &led->next_frame);
+
+			// Patterns the hardware can run need no frames until the layer
+			// expires or another one takes over. Handing a pattern over or
+			// taking it back changes the output even at the same level.
+			if (backend->offload != NULL) {
+				int was_hw = led->hw_blink;
+				int hw = 0;
+				const struct layer *top = layer_top(&led->layers);
+				if (top != NULL && !led->layers.fading &&
+				    (hw = backend->offload(led, &top->pattern)) != 0) {
+					led->next_frame = top->expires;
+				} else {
+					led->hw_blink = 0;
+				}
+				if (led->hw_blink != was_hw || hw == 2) {
+					led->shadow_valid = 0;
+				}
+			}
+		}
+
+		uint64_t pwm_next = 0;
+		led->level = soft_pwm ? soft_pwm_level(led->brightness, now, &pwm_next) : led->brightness;
+		led->next_edge = earliest(led->next_frame, pwm_next);
+		led->dirty = 1;
+		due = 1;
+	}
+
+	if (due) {
+		write_leds();
+	}
+}
+
+// Hand the dirty LEDs to the backend, except those whose level is already
+// on the line, and remember what was written
+static void write_leds(void) {
+	uint64_t written = 0;
+	int lit = 0;
+
+	for (int i = 0; i < led_count; i++) {
+		lit |= leds[i].dirty && leds[i].level != LEVEL_OFF;
+	}
+	// Unclaimed lines are left alone until something lights up
+	if (!leds_claimed && !lit) {
+		for (int i = 0; i < led_count; i++) {
+			leds[i].dirty = 0;
+		}
+		return;
+	}
+	if (!leds_claimed && acquire_leds() == -1) {
+		if (++write_failures == DIAG_WRITE_FAILS) {
+			write_failures = 0;
+			pending_diag = DIAG_WRITES;
+		}
+		return;
+	}
+
+	for (int i = 0; i < led_count; i++) {
+		struct led *led = &leds[i];
+		if (!led->dirty) {
+			continue;
+		}
+		if (led->shadow_valid && led->shadow == led->level) {
+			led->dirty = 0;
+			led_stats.suppressed++;
+			continue;
+		}
+		written |= 1ULL << i;
+	}
+	if (written == 0) {
+		return;
+	}
+
+	uint64_t start = trace_now();
+	int ret = backend->write(leds, led_count);
+	trace_dispatch("write", start);
+	histogram_observe(&led_stats.write_us, (uint32_t)(trace_now() - start));
+	led_stats.writes++;
+	write_failures = ret == 0 ? 0 : write_failures + 1;
+	if (write_failures == DIAG_WRITE_FAILS) {
+		write_failures = 0;
+		pending_diag = DIAG_WRITES;
+	}
+	for (int i = 0; i < led_count; i++) {
+		if (written & (1ULL << i)) {
+			trace_edge(leds[i].name, leds[i].level);
+			leds[i].shadow = leds[i].level;
+			leds[i].shadow_valid = ret == 0;
+			led_stats.changes++;
+		}
+	}
+}
+
+static uint64_t leds_next_edge(void) {
+	uint64_t next = 0;
+	for (int i = 0; i < led_count; i++) {
+		next = earliest(next, leds[i].next_edge);
+	}
+	return next;
+}
+
+// Solid on while the button is held, fast blink once the long press
+// threshold is reached, back to whatever was underneath on release
+void button_feedback(const struct button *b) {
+	uint64_t now = now_ms();
+	struct pattern p;
+
+	hide_pattern(LAYER_ID_BUTTON);
+	if (b->pressed && b->long_armed) {
+		pattern_blink(&p, FEEDBACK_BLINK_MS, FEEDBACK_BLINK_MS);
+		show_pattern(LAYER_ID_BUTTON, LAYER_ALERT, &p, now, 0);
+	} else if (b->pressed) {
+		pattern_solid(&p, LEVEL_ON);
+		show_pattern(LAYER_ID_BUTTON, LAYER_ALERT, &p, now, 0);
+	}
+	update_leds(now, 1);
+}
+
+// Acknowledge a recognised gesture with one flash per press
+static void button_ack(int count) {
+	uint64_t now = now_ms();
+	struct pattern p;
+
+	if (count > PATTERN_MAX_STEPS / 2) {
+		count = PATTERN_MAX_STEPS / 2;
+	}
+	p.ext = NULL;
+	p.nsteps = 0;
+	for (int i = 0; i < count; i++) {
+		p.steps[p.nsteps++] = (struct step){ LEVEL_OFF, ACK_FLASH_MS, EASE_STEP, COLOR_INHERIT };
+		p.steps[p.nsteps++] = (struct step){ LEVEL_ON, ACK_FLASH_MS, EASE_STEP, COLOR_INHERIT };
+	}
+	p.period = (uint32_t)p.nsteps * ACK_FLASH_MS;
+	p.phase = 0;
+	hide_pattern(LAYER_ID_BUTTON_ACK);
+	show_pattern(LAYER_ID_BUTTON_ACK, LAYER_ALERT, &p, now, p.period);
+	update_leds(now, 1);
+}
+
+void button_event(const struct button *b, enum press_kind kind, int count) {
+	static const char *const kind_names[] = {
+		[PRESS_SHORT] = "short",
+		[PRESS_LONG] = "long",
+		[PRESS_MULTI] = "multi",
+	};
+
+	syslog(LOG_INFO, "Button on GPIO %d: %s press (%d)", b->gpio, kind_names[kind], count);
+	button_ack(kind == PRESS_LONG ? 1 : count);
+	if (kind != PRESS_MULTI) {
+		stage_event(kind == PRESS_LONG ? STAGE_LONG : STAGE_SHORT, now_ms());
+	}
+	if (kind == PRESS_MULTI && count == readout_presses) {
+		char ip[INET_ADDRSTRLEN];
+		if (local_ip(ip, sizeof(ip)) == 0) {
+			show_readout(ip, READOUT_BLINK, READOUT_REPEAT, now_ms());
+		}
+	}
+	if (button_action != NULL) {
+		run_action(button_action, kind_names[kind], count);
+	}
+}
+
+// Spawn the action without waiting for it, the loop reaps it later
+static void run_action(const char *cmd, const char *kind, int count) {
+	char count_buf[16];
+	snprintf(count_buf, sizeof(count_buf), "%d", count);
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		syslog(LOG_ERR, "Failed to fork for button action %s", cmd);
+		return;
+	}
+	if (pid == 0) {
+		execl(cmd, cmd, kind, count_buf, (char *)NULL);
+		_exit(127);
+	}
+}
+
+// Parse "gpio_led_<name>=<gpio>[o|O]" lines, checking if active_low or active_high
+static int parse_led_entries(FILE *fp) {
+	char buffer[MAX_BUF];
+	int count = 0;
+
+	while (fgets(buffer, sizeof(buffer), fp) != NULL && count < MAX_LEDS) {
+		char *pos = strchr(buffer, '=');
+		if (pos == NULL || strncmp(buffer, "gpio_led_", strlen("gpio_led_")) != 0) {
+			continue;
+		}
+
+		struct led *led = &leds[count];
+		led->gpio = parse_gpio_spec(pos + 1, &led->active_low);
+		if (led->gpio < 0) {
+			continue;
+		}
+
+		*pos = '\0';
+		snprintf(led->name, sizeof(led->name), "%.*s", LED_NAME_MAX - 1, buffer + strlen("gpio_led_"));
+		count++;
+	}
+	return count;
+}
+
+static int get_leds_from_fw(void) {
 	FILE *fp = popen(FW_PRINTENV_CMD, "r");
 	if (fp == NULL) {
 		syslog(LOG_ERR, "Failed to run fw_printenv");
+		return 0;
+	}
+	int count = parse_led_entries(fp);
+	pclose(fp);
+
+	// If no gpio_led entry was found, log an error
+	if (count == 0) {
+		syslog(LOG_ERR, "No gpio_led entries found in fw_printenv");
+	}
+
+	return count;
+}
+
+// The entries last read from the environment, for boots where it cannot be
+// read. Only rewritten when they changed, to spare the flash.
+static void save_led_cache(void) {
+	char text[MAX_LEDS * MAX_BUF], old[sizeof(text)];
+	size_t len = 0;
+
+	for (int i = 0; i < led_count && len < sizeof(text); i++) {
+		len += (size_t)snprintf(text + len, sizeof(text) - len, "gpio_led_%s=%d%s\n", leds[i].name,
+		                        leds[i].gpio, leds[i].active_low ? "o" : "");
+	}
+	if (len >= sizeof(text)) {
+		return;
+	}
+
+	FILE *fp = fopen(LED_CACHE_FILE, "r");
+	if (fp != NULL) {
+		size_t old_len = fread(old, 1, sizeof(old), fp);
+		fclose(fp);
+		if (old_len == len && memcmp(old, text, len) == 0) {
+			return;
+		}
+	}
+	fp = fopen(LED_CACHE_FILE ".tmp", "w");
+	if (fp == NULL) {
+		return;
+	}
+	int ok = fwrite(text, 1, len, fp) == len;
+	if (fclose(fp) == 0 && ok) {
+		rename(LED_CACHE_FILE ".tmp", LED_CACHE_FILE);
+	} else {
+		unlink(LED_CACHE_FILE ".tmp");
+	}
+}
+
+// Discovery sources in order: the environment, then its cached copy
+static int discover_leds(void) {
+	int count = get_leds_from_fw();
+	if (count > 0) {
+		led_count = count;
+		save_led_cache();
+		return count;
+	}
+
+	FILE *fp = fopen(LED_CACHE_FILE, "r");
+	if (fp != NULL) {
+		count = parse_led_entries(fp);
+		fclose(fp);
+	}
+	if (count > 0) {
+		syslog(LOG_WARNING, "Using the LEDs cached in %s", LED_CACHE_FILE);
+		pending_diag = DIAG_ENV_CACHED;
+	}
+	return count;
+}
+
+static int get_button_from_fw(int *active_low) {
+	FILE *fp = popen(FW_BUTTON_CMD, "r");
+	if (fp == NULL) {
 		return -1;
 	}
 
 	char buffer[MAX_BUF];
-	int gpio_pin = -1;
-
-	// Parse the fw_printenv output for the GPIO pin and check if active_low or active_high
-	while (fgets(buffer, sizeof(buffer), fp) != NULL) {
+	int gpio = -1;
+	if (fgets(buffer, sizeof(buffer), fp) != NULL) {
 		char *pos = strchr(buffer, '=');
 		if (pos != NULL) {
-			long val = strtol(pos + 1, NULL, 10);
-			if (val >= 0) {
-				gpio_pin = (int)val;
-
-				// logic for interpreting the suffix 'o' or 'O'
-				if (strchr(pos + 1, 'o')) {
-					active_low = 1;  // Active low (0 means on, 1 means off)
-					off_value = 1;   // Set off_value to 1 (high is off, low is on)
-				} else if (strchr(pos + 1, 'O')) {
-					active_low = 0;  // Active high (1 means on, 0 means off)
-					off_value = 0;   // Set off_value to 0 (low is off, high is on)
-				} else {
-					// No suffix, assume active high and off is 0
-					active_low = 0;
-					off_value = 0;
-				}
-				break;
-			}
+			gpio = parse_gpio_spec(pos + 1, active_low);
 		}
 	}
 
 	pclose(fp);
+	return gpio;
+}
 
-	// If no gpio_led entry was found, log an error and return -1
-	if (gpio_pin == -1) {
-		syslog(LOG_ERR, "No gpio_led entries found in fw_printenv");
+// Parse a "<gpio>[o|O]" value as used by the gpio_* environment entries
+static int parse_gpio_spec(const char *spec, int *active_low) {
+	char *end;
+	long val = strtol(spec, &end, 10);
+	if (end == spec || val < 0) {
+		return -1;
+	}
+
+	// logic for interpreting the suffix 'o' or 'O'
+	if (strchr(end, 'o')) {
+		*active_low = 1;  // Active low (0 means on, 1 means off)
+	} else {
+		*active_low = 0;  // 'O' or no suffix, active high (1 means on, 0 means off)
+	}
+	return (int)val;
+}
+
+// Map the comma separated LED names of the strip to LED indexes
+static int resolve_strip(const char *spec) {
+	char buf[MAX_BUF * 2];
+	char *save = NULL;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	strip_count = 0;
+	for (char *name = strtok_r(buf, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+		int i;
+		for (i = 0; i < led_count; i++) {
+			if (strcmp(leds[i].name, name) == 0) {
+				break;
+			}
+		}
+		if (i == led_count || strip_count == MAX_LEDS) {
+			fprintf(stderr, "Unknown or too many strip LEDs: %s\n", name);
+			return -1;
+		}
+		strip[strip_count++] = i;
 	}
+	return 0;
+}
 
-	return gpio_pin;
+static void color_pixels(int color) {
+	for (int i = 0; i < led_count; i++) {
+		leds[i].color = (uint8_t)color;
+		leds[i].shadow_valid = 0;
+	}
+}
+
+static int parse_ms(const char *arg, unsigned int *out) {
+	char *end;
+	errno = 0;
+	unsigned long val = strtoul(arg, &end, 10);
+	if (errno != 0 || end == arg || *end != '\0' || val > 3600000) {
+		return -1;
+	}
+	*out = (unsigned int)val;
+	return 0;
 }
 
 static void handle_signal(int sig) {
 	if (sig == SIGTERM || sig == SIGINT) {
 		keep_running = 0;
+	} else if (sig == SIGUSR1) {
+		stats_requested = 1;
 	}
 }
 
@@ -206,12 +1744,232 @@ static void setup_signal_handling(void) {
 	sa.sa_handler = handle_signal;
 	sigemptyset(&sa.sa_mask);
 	sa.sa_flags = 0;
-	if (sigaction(SIGTERM, &sa, NULL) == -1 || sigaction(SIGINT, &sa, NULL) == -1) {
+	if (sigaction(SIGTERM, &sa, NULL) == -1 || sigaction(SIGINT, &sa, NULL) == -1 ||
+	    sigaction(SIGUSR1, &sa, NULL) == -1) {
 		syslog(LOG_ERR, "Error setting up signal handler");
 		exit(EXIT_FAILURE);
 	}
 }
 
+// Watch the directory of the monitored file, the file itself comes and goes
+static int watch_open(void) {
+	char dir[PATH_MAX];
+	snprintf(dir, sizeof(dir), "%s", monitor_file);
+	char *slash = strrchr(dir, '/');
+	if (slash == NULL) {
+		snprintf(dir, sizeof(dir), ".");
+	} else {
+		slash[slash == dir] = '\0';  // Keep the slash of "/"
+	}
+
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	if (inotify_add_watch(fd, dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+	                      IN_CLOSE_WRITE) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Drain the queued events, returns the mask of those about the monitored
+// file, with IN_CREATE set if the queue overflowed, and adds their number
+// to count
+static int watch_read(unsigned long *count) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const char *base = strrchr(monitor_file, '/');
+	int mask = 0;
+	ssize_t len;
+
+	base = base ? base + 1 : monitor_file;
+	while ((len = read(watch_fd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + len; ) {
+			const struct inotify_event *ev = (const struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				mask |= IN_CREATE;
+				(*count)++;
+			} else if (ev->len > 0 && strcmp(ev->name, base) == 0) {
+				mask |= (int)ev->mask;
+				(*count)++;
+			}
+			p += sizeof(*ev) + ev->len;
+		}
+	}
+	return mask;
+}
+
+// Wakeups and what they cost, on exit and on SIGUSR1
+static void log_stats(void) {
+	char line[MAX_BUF * 2];
+	unsigned long voluntary = 0, involuntary = 0;
+	unsigned long utime = 0, stime = 0;
+
+	FILE *fp = fopen("/proc/self/status", "r");
+	if (fp != NULL) {
+		while (fgets(line, sizeof(line), fp) != NULL) {
+			sscanf(line, "voluntary_ctxt_switches: %lu", &voluntary);
+			sscanf(line, "nonvoluntary_ctxt_switches: %lu", &involuntary);
+		}
+		fclose(fp);
+	}
+
+	// utime and stime are the 14th and 15th fields, after the parenthesised name
+	fp = fopen("/proc/self/stat", "r");
+	if (fp != NULL) {
+		if (fgets(line, sizeof(line), fp) != NULL) {
+			const char *p = strrchr(line, ')');
+			if (p != NULL) {
+				sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+			}
+		}
+		fclose(fp);
+	}
+
+	long hz = sysconf(_SC_CLK_TCK);
+	syslog(LOG_INFO, "Wakeups: %lu, context switches: %lu voluntary, %lu involuntary, CPU: %lu ms",
+	       led_stats.wakeups, voluntary, involuntary, hz > 0 ? (utime + stime) * 1000 / (unsigned long)hz : 0);
+	syslog(LOG_INFO, "LED writes: %lu, levels written: %lu, suppressed: %lu, resyncs: %lu",
+	       led_stats.writes, led_stats.changes, led_stats.suppressed, led_stats.resyncs);
+	syslog(LOG_INFO, "File events: %lu, coalesced: %lu", led_stats.file_events,
+	       led_stats.file_coalesced);
+	if (identify_fd >= 0) {
+		syslog(LOG_INFO, "Identify datagrams: %lu, accepted: %lu, rejected: %lu, replayed: %lu, "
+		       "rate limited: %lu", identify_stats.received, identify_stats.accepted,
+		       identify_stats.rejected, identify_stats.replayed, identify_stats.limited);
+	}
+	if (beacon_fd >= 0) {
+		syslog(LOG_INFO, "Beacons sent: %lu, received: %lu, steps: %lu, last error: %ld us",
+		       beacon_stats.sent, beacon_stats.received, beacon_stats.steps, beacon_stats.error_us);
+	}
+}
+
+// Take the listening sockets a supervisor passed as LISTEN_FDS, if they are
+// meant for this process. Read before anything else opens a descriptor.
+static void inherit_sockets(void) {
+	const char *pid = getenv("LISTEN_PID");
+	const char *fds = getenv("LISTEN_FDS");
+	const char *names = getenv("LISTEN_FDNAMES");
+
+	if (pid != NULL && fds != NULL && strtol(pid, NULL, 10) == (long)getpid()) {
+		listen_fd_count = atoi(fds);
+		if (listen_fd_count < 0 || listen_fd_count > SERVER_COUNT) {
+			listen_fd_count = 0;
+		}
+		snprintf(listen_fd_names, sizeof(listen_fd_names), "%s", names ? names : "");
+		for (int i = 0; i < listen_fd_count; i++) {
+			fcntl(LISTEN_FDS_START + i, F_SETFD, FD_CLOEXEC);
+		}
+	}
+	unsetenv("LISTEN_PID");  // Not for the button action
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+}
+
+// Serve the inherited sockets. A socket named "metrics" serves metrics,
+// any other one the control endpoint.
+static void adopt_sockets(void) {
+	char *save = NULL;
+	char *name = strtok_r(listen_fd_names, ":", &save);
+
+	for (int i = 0; i < listen_fd_count; i++, name = strtok_r(NULL, ":", &save)) {
+		int fd = LISTEN_FDS_START + i;
+		int metrics = name != NULL && strcmp(name, "metrics") == 0;
+		struct http_server *s = metrics ? &metrics_server : &control_server;
+		if (s->fd >= 0) {
+			http_close(s);
+		}
+		if (metrics) {
+			metrics_init(backend, leds, &led_count);
+		}
+		if (http_adopt(s, fd, metrics ? metrics_handler : control_handler) == -1) {
+			syslog(LOG_ERR, "Inherited fd %d is not a listening stream socket", fd);
+			close(fd);
+		}
+	}
+}
+
+// Hold an exclusive lock on the pid file for as long as this process, or
+// its daemonized child, runs. Two instances would fight over the same
+// lines. With -O a running instance is asked to hand over through its
+// control endpoint, and its lock is awaited.
+static int lock_instance(void) {
+	char buf[MAX_BUF] = "";
+
+	pid_fd = open(pid_file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (pid_fd < 0) {
+		fprintf(stderr, "Failed to open %s: %s\n", pid_file, strerror(errno));
+		return -1;
+	}
+	if (flock(pid_fd, LOCK_EX | LOCK_NB) == 0) {
+		return 0;
+	}
+
+	ssize_t len = pread(pid_fd, buf, sizeof(buf) - 1, 0);
+	long pid = len > 0 ? strtol(buf, NULL, 10) : 0;
+	if (!takeover) {
+		fprintf(stderr, "Already running as pid %ld, -O takes over\n", pid);
+		return -1;
+	}
+	if (control_addr == NULL) {
+		fprintf(stderr, "Taking over needs the control endpoint of pid %ld in -C\n", pid);
+		return -1;
+	}
+	if (http_fetch(control_addr, "POST", "/takeover", handover, sizeof(handover)) == -1) {
+		fprintf(stderr, "Pid %ld did not hand over on %s\n", pid, control_addr);
+		return -1;
+	}
+	for (int waited = 0; flock(pid_fd, LOCK_EX | LOCK_NB) == -1; waited += 50) {
+		if (waited >= TAKEOVER_WAIT_MS) {
+			fprintf(stderr, "Pid %ld did not exit after handing over\n", pid);
+			return -1;
+		}
+		usleep(50 * 1000);
+	}
+	return 0;
+}
+
+// After daemonizing, so the file names the process holding the lock
+static void write_pid(void) {
+	char buf[MAX_BUF];
+
+	if (pid_fd < 0) {
+		return;
+	}
+	int len = snprintf(buf, sizeof(buf), "%ld\n", (long)getpid());
+	if (ftruncate(pid_fd, 0) == -1 || pwrite(pid_fd, buf, (size_t)len, 0) != len) {
+		syslog(LOG_WARNING, "Failed to write %s: %s", pid_file, strerror(errno));
+	}
+}
+
+// Carry on with the color and control pattern of the instance taken over
+static void apply_handover(uint64_t now) {
+	char spec[PATTERN_SPEC_MAX], value[MAX_BUF];
+	unsigned int remaining = 0, half = 0;
+
+	if (http_param(handover, "color", value, sizeof(value)) == 0 && color_lookup(value) != -1) {
+		set_status_color(color_lookup(value));
+	}
+	if (http_param(handover, "control", spec, sizeof(spec)) == 0 && spec[0] != '\0' &&
+	    pattern_valid(spec)) {
+		if (http_param(handover, "interval", value, sizeof(value)) == 0) {
+			half = (unsigned int)strtoul(value, NULL, 10);
+		}
+		if (http_param(handover, "remaining", value, sizeof(value)) == 0) {
+			remaining = (unsigned int)strtoul(value, NULL, 10);
+		}
+		if (half == 0) {
+			half = (unsigned int)(blink_interval * 1000);
+		}
+		show_spec(LAYER_ID_CONTROL, LAYER_STATUS, spec, half, now, remaining);
+		snprintf(control_spec, sizeof(control_spec), "%s", spec);
+		control_expires = remaining ? now + remaining : 0;
+		control_half_ms = half;
+	}
+	syslog(LOG_INFO, "Took over from the previous instance");
+}
+
 static void init_daemon(void) {
 	pid_t pid = fork();
 	if (pid < 0) {
@@ -246,17 +2004,32 @@ static void init_daemon(void) {
 }
 
 static void reset_gpio_state(void) {
-	set_gpio_value(gpio_pin, off_value);  // Always set to "off"
+	// Always set to "off"
+	for (int i = 0; i < led_count; i++) {
+		leds[i].layers.depth = 0;
+		leds[i].brightness = LEVEL_OFF;
+		leds[i].level = LEVEL_OFF;
+		leds[i].next_edge = 0;
+		leds[i].next_frame = 0;
+		leds[i].dirty = 1;
+		if (leds[i].hw_blink) {
+			leds[i].hw_blink = 0;
+			leds[i].shadow_valid = 0;
+		}
+	}
+	write_leds();
 }
 
-static double read_blink_interval_from_file(const char *file_path) {
+// The first line of the monitored file is "<interval> [color] [pattern]"
+static double read_blink_interval_from_file(const char *file_path, int *color,
+                                            char *pattern, size_t pattern_len) {
 	FILE *file = fopen(file_path, "r");
 	if (file == NULL) {
 		syslog(LOG_ERR, "Failed to open monitored file %s", file_path);
 		return -1.0;
 	}
 
-	char buf[MAX_BUF];
+	char buf[PATTERN_SPEC_MAX + MAX_BUF];
 	if (fgets(buf, sizeof(buf), file) == NULL) {
 		syslog(LOG_ERR, "Failed to read from monitored file %s", file_path);
 		fclose(file);
@@ -266,7 +2039,23 @@ static double read_blink_interval_from_file(const char *file_path) {
 	fclose(file);
 
 	// Convert the string to a double representing the blink interval
-	double new_interval = strtod(buf, NULL);
+	char *end;
+	double new_interval = strtod(buf, &end);
+	char tok[PATTERN_SPEC_MAX];
+	int len;
+	while (sscanf(end, "%255s%n", tok, &len) == 1) {
+		end += len;
+		int c = color_lookup(tok);
+		if (c != -1) {
+			*color = c;
+		} else {
+			if (pattern_valid(tok)) {
+				snprintf(pattern, pattern_len, "%s", tok);
+			} else {
+				syslog(LOG_ERR, "Invalid pattern in file: %s", tok);
+			}
+		}
+	}
 	if (new_interval <= 0) {
 		syslog(LOG_ERR, "Invalid blink interval value in file: %s", buf);
 		return -1.0;
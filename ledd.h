@@ -0,0 +1,517 @@
+#ifndef LEDD_H
+#define LEDD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <poll.h>
+#include <linux/gpio.h>
+
+#define MAX_BUF 64
+#define GPIO_CONSUMER "ledd"
+
+#define LEVEL_OFF 0
+#define LEVEL_ON 255
+#define PATTERN_MAX_STEPS 16
+#define LAYER_STACK_MAX 8
+#define MAX_LEDS 64
+#define LED_NAME_MAX 16
+#define GROUP_MAX_CHANNELS 3
+#define COLOR_COUNT 11
+#define MATRIX_MAX_LINES 8
+#define MATRIX_SCAN_HZ 100  // Refresh rate of every matrix row
+#define COLOR_INHERIT 0xff
+#define PATTERN_SPEC_MAX 256
+
+// Backend capabilities
+#define LED_CAP_PWM      (1 << 0)  // Levels are written as duty cycles
+#define LED_CAP_SOFT_PWM (1 << 1)  // Writes are cheap enough for software PWM
+#define LED_CAP_RGB      (1 << 2)  // Every LED is a full color pixel
+
+// How a step moves from the previous level to its own
+enum ease {
+	EASE_STEP,  // Jump at the start of the step
+	EASE_LINEAR,
+	EASE_IN,
+	EASE_OUT,
+	EASE_IN_OUT,
+	EASE_COUNT,
+};
+
+// A pattern is a cycle of keyframe steps, each reaching a level (and
+// optionally a color) and holding it for the rest of its duration. A
+// single step with a zero period is a static level.
+struct step {
+	uint8_t level;
+	uint32_t ms;
+	uint8_t ease;   // enum ease
+	uint8_t color;  // Color index, COLOR_INHERIT for the status color
+};
+
+struct pattern {
+	struct step steps[PATTERN_MAX_STEPS];
+	const struct step *ext;  // Longer step list kept by the caller, NULL to use steps
+	int nsteps;
+	uint32_t period;  // Sum of the step durations, 0 for a static level
+	uint32_t phase;   // Offset into the cycle at the epoch
+};
+
+// How a readout spells its text
+enum readout_mode {
+	READOUT_BLINK,  // Digits as that many flashes, separators as a long flash
+	READOUT_MORSE,
+};
+
+// Choreographies for a strip of LEDs
+enum choreo {
+	CHOREO_CHASER,
+	CHOREO_BOUNCE,
+	CHOREO_ALTERNATE,
+	CHOREO_COUNT,
+};
+
+// Layer priorities, the highest active layer drives the output
+enum layer_prio {
+	LAYER_BASE,
+	LAYER_STATUS,
+	LAYER_ALERT,
+};
+
+// Layer ids, one per source that can put a pattern on the LED
+enum layer_id {
+	LAYER_ID_BOOT,
+	LAYER_ID_BUTTON,
+	LAYER_ID_BUTTON_ACK,
+	LAYER_ID_CONTROL,
+	LAYER_ID_IDENTIFY,
+	LAYER_ID_READOUT,
+	LAYER_ID_DIAG,
+};
+
+struct layer {
+	int id;
+	enum layer_prio prio;
+	uint32_t seq;      // Push sequence number, identifies the layer instance
+	struct pattern pattern;
+	uint64_t epoch;    // Time the pattern started, phase is relative to it
+	uint64_t expires;  // 0 for layers that stay until popped
+	int synced;        // Phase follows the wall clock, see layer_sync()
+	int32_t slew;      // Phase correction still to be applied, ms
+};
+
+// Fixed capacity, push and pop never allocate
+struct layer_stack {
+	struct layer layers[LAYER_STACK_MAX];
+	int depth;
+	uint8_t level;        // Last evaluated level
+	uint32_t top_seq;     // Top layer at the last evaluation
+	int fading;           // Crossfading from fade_from to the top layer
+	uint8_t fade_from;
+	uint64_t fade_start;
+};
+
+enum trace_type {
+	TRACE_EDGE,      // Level handed to the backend
+	TRACE_WAKEUP,    // Return from poll()
+	TRACE_DISPATCH,  // Handling of an event, with its duration
+};
+
+// Button press classification, reported once per gesture
+enum press_kind {
+	PRESS_SHORT,
+	PRESS_LONG,
+	PRESS_MULTI,
+};
+
+struct button {
+	int gpio;
+	int active_low;
+	int fd;                    // line request fd, -1 when not claimed
+	int pressed;
+	int ignore;                // held at startup, wait for a release first
+	int count;                 // presses in the current gesture
+	int long_armed;            // long-press threshold reached while held
+	uint64_t press_ts;         // event timestamp of the last press (ns)
+	uint64_t long_deadline;    // monotonic ms, 0 when not pending
+	uint64_t gap_deadline;     // monotonic ms, 0 when not pending
+	unsigned int debounce_ms;
+	unsigned int long_ms;
+	unsigned int multi_gap_ms;
+};
+
+// One output line, named after its gpio_led_<name> environment entry
+struct led {
+	char name[LED_NAME_MAX];
+	int gpio;
+	int active_low;
+	struct layer_stack layers;
+	uint64_t next_edge;   // Next level change, 0 when the output is static
+	uint64_t next_frame;  // Next time the layers need evaluating
+	uint8_t brightness;   // Level the layers want
+	uint8_t level;        // Level to write, on/off while software PWM runs
+	int dirty;            // Level needs writing by the backend
+	uint8_t shadow;       // Level the backend last wrote
+	int shadow_valid;     // Clear to force the next write
+	int hw_blink;         // The backend runs the top pattern by itself
+	uint8_t color;        // Color shown by full color pixels
+	int req;             // Backend private: line request index
+	int bit;             // Backend private: line bit within the request
+};
+
+// Output backends write every dirty LED in as few syscalls as they can and
+// clear the dirty flags
+struct led_backend {
+	const char *name;
+	int caps;               // LED_CAP_*
+	unsigned int frame_ms;  // Shortest useful animation frame with PWM
+	int (*open)(struct led *leds, int count);
+	int (*write)(struct led *leds, int count);
+	void (*close)(struct led *leds, int count);
+	// Optional: take over a pattern in hardware, returns 1 if it did, 2 if
+	// it did and the next write must reach the hardware to apply it
+	int (*offload)(struct led *led, const struct pattern *p);
+};
+
+// Raw output line sets, for drivers that multiplex lines themselves. All
+// lines of a set change together with one set() call.
+struct line_ops {
+	const char *name;
+	int (*request)(const int *gpios, const int *active_low, int count);  // Returns a handle
+	int (*set)(int handle, uint64_t mask, uint64_t bits);
+	void (*release)(int handle);
+};
+
+#define MOCK_LINE_SETS 4
+
+struct mock_lines {
+	int nlines;
+	uint64_t bits;           // Logical line values
+	unsigned long writes;    // set() calls, each would be one ioctl
+};
+
+// Row/column multiplexed LED matrix, see matrix.c
+struct matrix {
+	int row_gpio[MATRIX_MAX_LINES];
+	int row_low[MATRIX_MAX_LINES];
+	int nrows;
+	int col_gpio[MATRIX_MAX_LINES];
+	int col_low[MATRIX_MAX_LINES];
+	int ncols;
+	const struct line_ops *ops;
+	int handle;
+	uint64_t all_mask;
+	uint8_t fb[MATRIX_MAX_LINES];           // Framebuffer, lit columns per row
+	int dirty;                              // Framebuffer changed since the last commit
+	uint64_t slot_value[MATRIX_MAX_LINES];  // Line values of each scanned row
+	int nlit;                               // Rows with something lit
+	int cur;
+	int restart;                            // Start scanning at the next service
+	uint32_t scan_hz;
+	uint32_t slot_ms;                       // Whole ms of a slot
+	uint32_t slot_rem;                      // Its fraction, in 1/slot_div ms
+	uint32_t slot_div;                      // Slots per second
+	uint32_t slot_acc;                      // Fractions carried so far
+	uint64_t next_slot;                     // 0 while no scanning is needed
+	uint64_t written;                       // Line values currently on the lines
+	unsigned long slots;                    // Slots served
+	unsigned long writes;                   // Slots that needed a write
+	unsigned long skipped;                  // Slots whose values were already set
+};
+
+// Mapped Ingenic GPIO port registers, see mmio.c
+struct gpio_regs {
+	volatile uint32_t *base;
+	size_t len;
+	int fd;
+	int file;  // Mapped from a regular file rather than /dev/mem
+};
+
+#define HISTOGRAM_MAX_BOUNDS 8
+
+// Fixed bucket histogram, counts[nbounds] holds what is above the last bound
+struct histogram {
+	const uint32_t *bounds;
+	int nbounds;
+	unsigned long counts[HISTOGRAM_MAX_BOUNDS + 1];
+	unsigned long count;
+	uint64_t sum;
+};
+
+struct led_stats {
+	unsigned long wakeups;     // Returns from poll(), the figure to keep low
+	unsigned long writes;      // Backend write calls
+	unsigned long changes;     // LED levels handed to the backend
+	unsigned long suppressed;  // LED levels dropped as already written
+	unsigned long resyncs;     // Periodic rewrites of every LED
+	unsigned long file_events;     // Inotify events about the monitored file
+	unsigned long file_coalesced;  // Of those, acted on together with an earlier one
+	struct histogram write_us;  // Backend write durations
+	struct histogram late_ms;   // Timer wakeups past their deadline
+};
+
+#define HTTP_MAX_CONN 4
+#define HTTP_REQ_MAX  512
+
+struct http_request {
+	char method[8];
+	char path[64];       // Without the query string
+	const char *query;   // After the '?', empty if none
+	const char *body;    // NUL terminated
+	int body_len;
+	int local;           // From a unix socket or a loopback address
+};
+
+struct http_response {
+	int status;
+	const char *type;  // Content type, text/plain if NULL
+	const char *body;  // Owned by the handler, must stay valid until it returns
+	int len;
+};
+
+typedef void (*http_handler)(const struct http_request *req, struct http_response *resp);
+
+struct http_conn {
+	int fd;  // -1 when the slot is free
+	char buf[HTTP_REQ_MAX];
+	int len;
+	uint64_t deadline;  // Dropped if idle until then
+	int local;          // Peer is on this machine
+};
+
+struct http_server {
+	int fd;  // Listening socket, -1 when disabled
+	struct http_conn conns[HTTP_MAX_CONN];
+	int nconns;
+	http_handler handler;
+};
+
+// Command received by the UDP identify listener
+struct identify_cmd {
+	int identify;                   // Identify pattern, else spec
+	char spec[PATTERN_SPEC_MAX];
+	uint32_t duration_ms;           // 0 for the default
+};
+
+struct identify_stats {
+	unsigned long received;  // Datagrams read
+	unsigned long accepted;
+	unsigned long rejected;  // Oversized, malformed, bad HMAC or replayed
+	unsigned long replayed;  // Of the rejected, stale or reused timestamps
+	unsigned long limited;   // Dropped by the rate limit without a look
+};
+
+struct beacon_stats {
+	unsigned long sent;      // Beacons multicast by the leader
+	unsigned long received;  // Beacons fed to the follower's filter
+	unsigned long steps;     // Estimate stepped instead of filtered
+	long error_us;           // Last measured error against the estimate
+};
+
+struct sim_stats {
+	unsigned long wakeups;  // Loop sleeps
+	unsigned long writes;   // Backend write calls
+};
+
+struct i2c_stats {
+	unsigned long bursts;   // Bus transactions
+	unsigned long bytes;    // Bytes sent including register pointers
+	unsigned long skipped;  // Writes that matched the cached registers
+};
+
+struct ws2812_stats {
+	unsigned long frames;   // SPI messages sent
+	unsigned long bytes;    // Encoded bytes sent
+	unsigned long skipped;  // Writes that encoded the frame already shown
+};
+
+// What a state machine from stage.c reacts to
+enum stage_event {
+	STAGE_PRESENT,  // The monitored file exists
+	STAGE_CHANGED,  // It was written to
+	STAGE_ABSENT,   // It does not exist
+	STAGE_SHORT,    // Button presses
+	STAGE_LONG,
+	STAGE_EVENT_COUNT,
+};
+
+#define STAGE_MAX_STATES 16
+#define STAGE_MAX_RULES  128  // After "*" rules are repeated for every state
+#define STAGE_NAME_MAX   16
+
+struct stage_state {
+	char name[STAGE_NAME_MAX];
+	char spec[PATTERN_SPEC_MAX];  // Pattern, "file" for the monitored file's, empty for off
+	uint32_t half_ms;             // 0 for the blink interval
+	int color;                    // -1 to keep the status color
+};
+
+struct stage_rule {
+	uint8_t to;
+	char guard[STAGE_NAME_MAX];  // First word of the monitored file, empty for none
+};
+
+// Transition table, the rules of (state, event) are rules[first] onwards
+struct stage_machine {
+	struct stage_state states[STAGE_MAX_STATES];
+	int nstates;
+	struct stage_rule rules[STAGE_MAX_RULES];
+	int nrules;
+	uint8_t first[STAGE_MAX_STATES][STAGE_EVENT_COUNT];
+	uint8_t count[STAGE_MAX_STATES][STAGE_EVENT_COUNT];
+	int guarded;  // Some rule needs the file's first word
+};
+
+// Color group over the r/g/b LEDs with a precomputed level table
+struct led_group {
+	int members[GROUP_MAX_CHANNELS];  // LED index per channel, -1 if missing
+	int count;
+	uint8_t table[COLOR_COUNT][GROUP_MAX_CHANNELS];
+};
+
+// ledd.c
+extern struct led_stats led_stats;
+uint64_t now_ms(void);
+void button_feedback(const struct button *b);
+void button_event(const struct button *b, enum press_kind kind, int count);
+
+// gpio.c
+extern const struct line_ops lines_chardev;
+extern const struct line_ops lines_mock;
+int gpio_request_outputs(const int *gpios, const int *active_low, int count);
+int gpio_set_values(int fd, uint64_t mask, uint64_t bits);
+const struct mock_lines *gpio_mock_lines(int handle);
+int gpio_request_input(int gpio, int active_low, unsigned int debounce_us);
+int gpio_get_line_value(int fd);
+int gpio_read_events(int fd, struct gpio_v2_line_event *ev, int max);
+extern const struct led_backend backend_sysfs;
+extern const struct led_backend backend_chardev;
+const struct led_backend *backend_find(const char *name);
+
+// mmio.c
+extern const char *gpio_mmio_path;
+extern const struct led_backend backend_mmio;
+extern const struct line_ops lines_mmio;
+int gpio_regs_map(struct gpio_regs *r, const char *path);
+void gpio_regs_unmap(struct gpio_regs *r);
+uint32_t gpio_regs_outputs(const struct gpio_regs *r, int port, uint32_t want);
+void gpio_regs_write(const struct gpio_regs *r, int port, uint32_t set, uint32_t clear);
+uint32_t gpio_regs_read(const struct gpio_regs *r, int port);
+
+// color.c
+int color_lookup(const char *name);
+const uint8_t *color_rgb(int color);
+const char *color_name(int color);
+int group_init_rgb(struct led_group *g, const struct led *leds, int count, int pwm);
+void group_pattern(struct pattern *dst, const struct pattern *src, const struct led_group *g,
+                   int channel, int color);
+
+// matrix.c
+extern struct matrix led_matrix;
+extern const struct led_backend backend_matrix;
+int matrix_parse(struct matrix *m, const char *spec);
+int matrix_open(struct matrix *m, const struct line_ops *ops);
+void matrix_close(struct matrix *m);
+void matrix_set(struct matrix *m, int row, int col, int on);
+void matrix_commit(struct matrix *m);
+uint64_t matrix_next_deadline(const struct matrix *m);
+int matrix_service(struct matrix *m, uint64_t now);
+int matrix_leds(struct matrix *m, struct led *leds);
+
+// i2c.c
+extern const struct led_backend backend_i2c;
+extern struct i2c_stats i2c_stats;
+extern uint8_t i2c_mock_regs[];
+int i2c_parse(const char *spec, struct led *leds);
+
+// ws2812.c
+extern const struct led_backend backend_ws2812;
+extern struct ws2812_stats ws2812_stats;
+extern uint8_t ws2812_mock_stream[];
+extern int ws2812_mock_len;
+int ws2812_parse(const char *spec, struct led *leds);
+
+// sim.c
+extern int sim_active;
+extern int sim_pwm;
+extern uint64_t sim_now;
+extern struct sim_stats sim_stats;
+extern const struct led_backend backend_sim;
+extern const struct led_backend backend_sim_pwm;
+int sim_load(const char *script, const char **file, struct led *leds);
+void sim_sleep(uint64_t deadline);
+void sim_finish(void);
+
+// trace.c
+extern int trace_enabled;
+int trace_open(int ftrace);
+void trace_close(void);
+uint64_t trace_now(void);
+void trace_edge(const char *led, uint8_t level);
+void trace_wakeup(const char *why);
+void trace_dispatch(const char *what, uint64_t start);
+int trace_export(const char *path);
+
+// http.c
+struct sockaddr_in;
+int net_parse_inet(const char *addr, struct sockaddr_in *sin);
+int http_listen(struct http_server *s, const char *addr, http_handler handler);
+int http_adopt(struct http_server *s, int fd, http_handler handler);
+void http_close(struct http_server *s);
+int http_pollfds(const struct http_server *s, struct pollfd *pfds);
+void http_service(struct http_server *s, const struct pollfd *pfds, uint64_t now);
+uint64_t http_next_deadline(const struct http_server *s);
+int http_param(const char *params, const char *key, char *out, size_t size);
+int http_fetch(const char *addr, const char *method, const char *path, char *out, size_t size);
+
+// identify.c
+extern struct identify_stats identify_stats;
+void hmac_sha256(const uint8_t *k, size_t klen, const void *msg, size_t len, uint8_t out[32]);
+int identify_open(const char *addr, const char *key_file);
+void identify_close(void);
+int identify_read(struct identify_cmd *cmd, uint64_t now);
+
+// beacon.c
+extern struct beacon_stats beacon_stats;
+int beacon_open(const char *spec);
+void beacon_close(void);
+uint64_t beacon_service(uint64_t now);
+int beacon_read(uint64_t now, int64_t *offset_ms);
+
+// metrics.c
+void histogram_observe(struct histogram *h, uint32_t value);
+void metrics_init(const struct led_backend *backend, const struct led *leds, const int *count);
+void metrics_handler(const struct http_request *req, struct http_response *resp);
+
+// group.c
+int choreo_lookup(const char *name);
+int pattern_valid(const char *spec);
+void choreo_pattern(struct pattern *p, enum choreo c, int member, int count, uint32_t slot_ms);
+
+// pattern.c
+void pattern_solid(struct pattern *p, uint8_t level);
+void pattern_blink(struct pattern *p, uint32_t on_ms, uint32_t off_ms);
+int pattern_parse(const char *spec, uint32_t interval_ms, struct pattern *p);
+int pattern_colored(const struct pattern *p);
+int pattern_readout(struct pattern *p, struct step *steps, int max, const char *text,
+                    enum readout_mode mode, uint32_t unit_ms);
+int layer_push(struct layer_stack *s, int id, enum layer_prio prio, const struct pattern *p,
+               uint64_t now, uint32_t duration_ms);
+void layer_pop(struct layer_stack *s, int id);
+const struct layer *layer_top(const struct layer_stack *s);
+void layer_sync(struct layer_stack *s, int id, uint64_t wall);
+void layer_retime(struct layer_stack *s, int64_t delta_ms);
+uint8_t layer_eval(struct layer_stack *s, uint64_t now, uint32_t frame_ms, uint32_t fade_ms,
+                   uint64_t *next);
+
+// stage.c
+int stage_load(struct stage_machine *m, const char *path);
+const char *stage_event_name(enum stage_event ev);
+int stage_next(const struct stage_machine *m, int state, enum stage_event ev, const char *word);
+
+// button.c
+int button_open(struct button *b);
+void button_close(struct button *b);
+void button_handle_events(struct button *b, uint64_t now);
+void button_handle_timeout(struct button *b, uint64_t now);
+uint64_t button_next_deadline(const struct button *b);
+
+#endif
@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "ledd.h"
+
+// Row/column multiplexed LED matrix. The desired state of every LED lives in
+// a framebuffer, one bitmap of lit columns per row. Each scan slot selects
+// one row and drives its columns, all lines in one set() call, so one
+// SET_VALUES ioctl per slot on the chardev lines.
+//
+// Rows with nothing lit are not scanned, and a slot whose line values equal
+// what is already on the lines is not rewritten. A single lit row (or an
+// empty matrix) therefore needs no scanning at all.
+
+struct matrix led_matrix;
+
+static int parse_lines(char *list, int *gpios, int *active_low) {
+	char *save = NULL;
+	int n = 0;
+
+	for (char *tok = strtok_r(list, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+		if (n == MATRIX_MAX_LINES) {
+			return -1;
+		}
+		char *end;
+		long gpio = strtol(tok, &end, 10);
+		if (end == tok || gpio < 0) {
+			return -1;
+		}
+		gpios[n] = (int)gpio;
+		active_low[n] = strchr(end, 'o') != NULL;
+		n++;
+	}
+	return n;
+}
+
+// "<row>,<row>...:<col>,<col>..." with the usual 'o' suffix for active low
+// lines, typically the column (cathode) side
+int matrix_parse(struct matrix *m, const char *spec) {
+	char buf[MAX_BUF * 2];
+
+	memset(m, 0, sizeof(*m));
+	m->handle = -1;
+	m->scan_hz = MATRIX_SCAN_HZ;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	char *cols = strchr(buf, ':');
+	if (cols == NULL) {
+		return -1;
+	}
+	*cols++ = '\0';
+
+	m->nrows = parse_lines(buf, m->row_gpio, m->row_low);
+	m->ncols = parse_lines(cols, m->col_gpio, m->col_low);
+	if (m->nrows <= 0 || m->ncols <= 0 || m->nrows * m->ncols > MAX_LEDS) {
+		return -1;
+	}
+	return 0;
+}
+
+int matrix_open(struct matrix *m, const struct line_ops *ops) {
+	int gpios[2 * MATRIX_MAX_LINES];
+	int active_low[2 * MATRIX_MAX_LINES];
+	int n = 0;
+
+	// Rows take the low bits of the line set, columns follow
+	for (int r = 0; r < m->nrows; r++, n++) {
+		gpios[n] = m->row_gpio[r];
+		active_low[n] = m->row_low[r];
+	}
+	for (int c = 0; c < m->ncols; c++, n++) {
+		gpios[n] = m->col_gpio[c];
+		active_low[n] = m->col_low[c];
+	}
+
+	m->ops = ops;
+	m->handle = ops->request(gpios, active_low, n);
+	if (m->handle < 0) {
+		return -1;
+	}
+	m->all_mask = (1ULL << n) - 1;
+	m->written = 0;
+	return 0;
+}
+
+void matrix_close(struct matrix *m) {
+	if (m->handle >= 0) {
+		m->ops->set(m->handle, m->all_mask, 0);
+		m->ops->release(m->handle);
+		m->handle = -1;
+	}
+}
+
+void matrix_set(struct matrix *m, int row, int col, int on) {
+	uint8_t bit = (uint8_t)(1 << col);
+	uint8_t fb = on ? (m->fb[row] | bit) : (m->fb[row] & ~bit);
+	if (fb != m->fb[row]) {
+		m->fb[row] = fb;
+		m->dirty = 1;
+	}
+}
+
+static void matrix_write(struct matrix *m, uint64_t value) {
+	m->slots++;
+	if (value == m->written) {
+		m->skipped++;
+		return;
+	}
+	if (m->ops->set(m->handle, m->all_mask, value) == 0) {
+		m->written = value;
+		m->writes++;
+	}
+}
+
+// Rebuild the per-slot line values after framebuffer changes and restart
+// the scan over the rows that have something lit
+void matrix_commit(struct matrix *m) {
+	if (!m->dirty) {
+		return;
+	}
+	m->dirty = 0;
+
+	m->nlit = 0;
+	for (int r = 0; r < m->nrows; r++) {
+		if (m->fb[r] == 0) {
+			continue;
+		}
+		m->slot_value[m->nlit] = (1ULL << r) | ((uint64_t)m->fb[r] << m->nrows);
+		m->nlit++;
+	}
+
+	// Keep the refresh rate per row constant, fewer lit rows means longer
+	// slots and fewer wakeups. Slots rarely last whole milliseconds, so the
+	// remainder is carried from slot to slot and the scan rate holds on
+	// average. The clock caps it at one slot per millisecond.
+	if (m->nlit > 1) {
+		m->slot_div = m->scan_hz * (uint32_t)m->nlit;
+		m->slot_ms = 1000 / m->slot_div;
+		m->slot_rem = 1000 % m->slot_div;
+		if (m->slot_ms == 0) {
+			m->slot_ms = 1;
+			m->slot_rem = 0;
+		}
+		m->slot_acc = 0;
+		m->cur = 0;
+		m->restart = 1;
+		return;
+	}
+
+	m->restart = 0;
+	m->next_slot = 0;
+	matrix_write(m, m->nlit ? m->slot_value[0] : 0);
+}
+
+uint64_t matrix_next_deadline(const struct matrix *m) {
+	return m->next_slot;
+}
+
+// Advance the scan if a slot is due, returns 1 when it did
+int matrix_service(struct matrix *m, uint64_t now) {
+	if (m->restart) {
+		m->restart = 0;
+		m->next_slot = now;
+	}
+	if (m->next_slot == 0 || now < m->next_slot) {
+		return 0;
+	}
+
+	matrix_write(m, m->slot_value[m->cur]);
+	m->cur = (m->cur + 1) % m->nlit;
+
+	// Drop slots we were too late for rather than bursting to catch up
+	m->next_slot += m->slot_ms;
+	m->slot_acc += m->slot_rem;
+	if (m->slot_acc >= m->slot_div) {
+		m->slot_acc -= m->slot_div;
+		m->next_slot++;
+	}
+	if (m->next_slot <= now) {
+		m->next_slot = now + m->slot_ms;
+	}
+	return 1;
+}
+
+// LED backend on top of the matrix. Each cell is an LED named r<row>c<col>,
+// its row and column kept in the backend private fields.
+
+int matrix_leds(struct matrix *m, struct led *leds) {
+	int count = 0;
+	for (int r = 0; r < m->nrows; r++) {
+		for (int c = 0; c < m->ncols; c++) {
+			struct led *led = &leds[count++];
+			memset(led, 0, sizeof(*led));
+			snprintf(led->name, sizeof(led->name), "r%uc%u", (unsigned char)r, (unsigned char)c);
+			led->gpio = -1;
+			led->req = r;
+			led->bit = c;
+		}
+	}
+	return count;
+}
+
+static int matrix_backend_open(struct led *leds, int count) {
+	(void)leds;
+	(void)count;
+	return matrix_open(&led_matrix, led_matrix.ops);
+}
+
+static int matrix_backend_write(struct led *leds, int count) {
+	for (int i = 0; i < count; i++) {
+		if (!leds[i].dirty) {
+			continue;
+		}
+		leds[i].dirty = 0;
+		matrix_set(&led_matrix, leds[i].req, leds[i].bit, leds[i].level != LEVEL_OFF);
+	}
+	matrix_commit(&led_matrix);
+	return 0;
+}
+
+static void matrix_backend_close(struct led *leds, int count) {
+	(void)leds;
+	(void)count;
+	matrix_close(&led_matrix);
+}
+
+const struct led_backend backend_matrix = {
+	.name = "matrix",
+	.caps = 0,
+	.open = matrix_backend_open,
+	.write = matrix_backend_write,
+	.close = matrix_backend_close,
+};
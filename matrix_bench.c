@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ledd.h"
+
+// Scan rate and CPU cost of the matrix driver on the mock lines, or on a
+// file mapped as the Ingenic GPIO registers. The scan
+// runs against a virtual millisecond clock so the numbers only reflect the
+// driver itself, not sleeping.
+
+static double cpu_seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void run(const char *name, struct matrix *m, uint64_t duration_ms, int animate) {
+	uint64_t now = 1;
+	unsigned long frames = 0;
+	int pos = 0;
+	int cells = m->nrows * m->ncols;
+
+	m->slots = m->writes = m->skipped = 0;
+	double start = cpu_seconds();
+	for (uint64_t end = now + duration_ms; now < end; now++) {
+		// Two lit cells chasing each other, one step per 100 ms
+		if (animate && now % 100 == 0) {
+			for (int k = 0; k < 2; k++) {
+				int cell = (pos + k * cells / 2) % cells;
+				matrix_set(m, cell / m->ncols, cell % m->ncols, 0);
+			}
+			pos = (pos + 1) % cells;
+			for (int k = 0; k < 2; k++) {
+				int cell = (pos + k * cells / 2) % cells;
+				matrix_set(m, cell / m->ncols, cell % m->ncols, 1);
+			}
+			matrix_commit(m);
+			frames++;
+		}
+		matrix_service(m, now);
+	}
+	double cpu = cpu_seconds() - start;
+
+	// The achievable rate is what one CPU could sustain at this cost per slot
+	printf("%-8s %8lu slots %8lu writes %6lu skipped %6lu frames %7.1f slots/s %6.0f ns/slot %9.0f max slots/s\n",
+	       name, m->slots, m->writes, m->skipped, frames,
+	       (double)m->slots * 1000.0 / (double)duration_ms,
+	       m->slots ? cpu * 1e9 / (double)m->slots : 0.0,
+	       cpu > 0 ? (double)m->slots / cpu : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+	const char *spec = argc > 1 ? argv[1] : "0,1,2,3:4o,5o,6o,7o";
+	uint64_t duration_ms = argc > 2 ? strtoull(argv[2], NULL, 10) * 1000 : 600000;
+	const struct line_ops *ops = &lines_mock;
+	struct matrix m;
+
+	// A register file instead of the mock measures the mmio stores
+	if (argc > 3) {
+		gpio_mmio_path = argv[3];
+		ops = &lines_mmio;
+	}
+	if (matrix_parse(&m, spec) == -1 || matrix_open(&m, ops) == -1) {
+		fprintf(stderr, "Invalid matrix: %s\n", spec);
+		return EXIT_FAILURE;
+	}
+	printf("%dx%d matrix, %u Hz per row, %llu s of virtual time\n",
+	       m.nrows, m.ncols, m.scan_hz, (unsigned long long)(duration_ms / 1000));
+
+	// Everything lit: every row scanned, every slot is a write
+	for (int r = 0; r < m.nrows; r++) {
+		for (int c = 0; c < m.ncols; c++) {
+			matrix_set(&m, r, c, 1);
+		}
+	}
+	matrix_commit(&m);
+	run("full", &m, duration_ms, 0);
+
+	// One row lit: driven statically, no scanning
+	for (int r = 1; r < m.nrows; r++) {
+		for (int c = 0; c < m.ncols; c++) {
+			matrix_set(&m, r, c, 0);
+		}
+	}
+	matrix_commit(&m);
+	run("one-row", &m, duration_ms, 0);
+
+	// Animated: the framebuffer changes every 100 ms, rows without lit cells
+	// drop out of the scan
+	for (int r = 0; r < m.nrows; r++) {
+		for (int c = 0; c < m.ncols; c++) {
+			matrix_set(&m, r, c, 0);
+		}
+	}
+	matrix_commit(&m);
+	run("chaser", &m, duration_ms, 1);
+
+	if (ops == &lines_mock) {
+		printf("mock line writes: %lu\n", gpio_mock_lines(m.handle)->writes);
+	}
+	matrix_close(&m);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "ledd.h"
+
+// Prometheus text exposition of the daemon's counters, served by http.c.
+// Every scrape renders into the same static buffer.
+
+#define METRICS_BUF_SIZE 8192
+
+static char metrics_buf[METRICS_BUF_SIZE];
+static int metrics_len;
+static const struct led_backend *metrics_backend;
+static const struct led *metrics_leds;
+static const int *metrics_led_count;
+
+void histogram_observe(struct histogram *h, uint32_t value) {
+	int i = 0;
+	while (i < h->nbounds && value > h->bounds[i]) {
+		i++;
+	}
+	h->counts[i]++;
+	h->count++;
+	h->sum += value;
+}
+
+void metrics_init(const struct led_backend *backend, const struct led *leds, const int *count) {
+	metrics_backend = backend;
+	metrics_leds = leds;
+	metrics_led_count = count;
+}
+
+__attribute__((format(printf, 1, 2)))
+static void put(const char *fmt, ...) {
+	va_list ap;
+	if (metrics_len >= (int)sizeof(metrics_buf)) {
+		return;
+	}
+	va_start(ap, fmt);
+	int len = vsnprintf(metrics_buf + metrics_len, sizeof(metrics_buf) - (size_t)metrics_len, fmt, ap);
+	va_end(ap);
+	if (len > 0) {
+		metrics_len += len;
+	}
+	if (metrics_len > (int)sizeof(metrics_buf)) {
+		metrics_len = (int)sizeof(metrics_buf);
+	}
+}
+
+static void put_counter(const char *name, const char *help, unsigned long value) {
+	put("# HELP ledd_%s %s\n# TYPE ledd_%s counter\nledd_%s %lu\n", name, help, name, name, value);
+}
+
+static void put_histogram(const char *name, const char *help, const struct histogram *h) {
+	unsigned long cumulative = 0;
+
+	put("# HELP ledd_%s %s\n# TYPE ledd_%s histogram\n", name, help, name);
+	for (int i = 0; i < h->nbounds; i++) {
+		cumulative += h->counts[i];
+		put("ledd_%s_bucket{le=\"%u\"} %lu\n", name, (unsigned int)h->bounds[i], cumulative);
+	}
+	put("ledd_%s_bucket{le=\"+Inf\"} %lu\nledd_%s_sum %llu\nledd_%s_count %lu\n",
+	    name, h->count, name, (unsigned long long)h->sum, name, h->count);
+}
+
+static void metrics_render(void) {
+	metrics_len = 0;
+
+	put_counter("wakeups_total", "Returns from poll().", led_stats.wakeups);
+	put_counter("backend_writes_total", "Backend write calls.", led_stats.writes);
+	put_counter("levels_written_total", "LED levels handed to the backend.", led_stats.changes);
+	put_counter("levels_suppressed_total", "LED levels dropped as already written.",
+	            led_stats.suppressed);
+	put_counter("resyncs_total", "Periodic rewrites of every LED.", led_stats.resyncs);
+	put_counter("file_events_total", "Inotify events about the monitored file.",
+	            led_stats.file_events);
+	put_counter("file_events_coalesced_total", "File events acted on together with an earlier one.",
+	            led_stats.file_coalesced);
+	put_counter("identify_received_total", "Identify datagrams read.", identify_stats.received);
+	put_counter("identify_accepted_total", "Identify commands accepted.", identify_stats.accepted);
+	put_counter("identify_rejected_total", "Identify datagrams oversized, malformed or failing "
+	            "verification.", identify_stats.rejected);
+	put_counter("identify_replayed_total", "Rejected identify datagrams with a stale or reused "
+	            "timestamp.", identify_stats.replayed);
+	put_counter("identify_limited_total", "Identify datagrams dropped by the rate limit.",
+	            identify_stats.limited);
+	put_histogram("write_duration_microseconds", "Time spent in backend writes.",
+	              &led_stats.write_us);
+	put_histogram("wakeup_lateness_milliseconds", "Timer wakeups past their deadline.",
+	              &led_stats.late_ms);
+
+	if (metrics_backend == &backend_i2c) {
+		put_counter("i2c_bursts_total", "I2C transactions.", i2c_stats.bursts);
+		put_counter("i2c_bytes_total", "I2C bytes sent.", i2c_stats.bytes);
+		put_counter("i2c_skipped_total", "I2C writes matching the cached registers.",
+		            i2c_stats.skipped);
+	} else if (metrics_backend == &backend_ws2812) {
+		put_counter("spi_frames_total", "WS2812 frames sent.", ws2812_stats.frames);
+		put_counter("spi_bytes_total", "WS2812 encoded bytes sent.", ws2812_stats.bytes);
+		put_counter("spi_skipped_total", "WS2812 frames already on the strip.", ws2812_stats.skipped);
+	} else if (metrics_backend == &backend_matrix) {
+		put_counter("matrix_slots_total", "Matrix scan slots served.", led_matrix.slots);
+		put_counter("matrix_writes_total", "Matrix slots that needed a write.", led_matrix.writes);
+		put_counter("matrix_skipped_total", "Matrix slots already set.", led_matrix.skipped);
+	}
+
+	put("# HELP ledd_led_level Level last handed to the backend.\n# TYPE ledd_led_level gauge\n");
+	for (int i = 0; i < *metrics_led_count; i++) {
+		put("ledd_led_level{led=\"%s\"} %u\n", metrics_leds[i].name,
+		    (unsigned int)metrics_leds[i].shadow);
+	}
+}
+
+void metrics_handler(const struct http_request *req, struct http_response *resp) {
+	if (strcmp(req->path, "/metrics") != 0) {
+		resp->status = 404;
+		return;
+	}
+	if (strcmp(req->method, "GET") != 0) {
+		resp->status = 405;
+		return;
+	}
+	metrics_render();
+	resp->status = 200;
+	resp->type = "text/plain; version=0.0.4";
+	resp->body = metrics_buf;
+	resp->len = metrics_len;
+}
@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ledd.h"
+
+// Ingenic GPIO port registers mapped through /dev/mem. A pin is a GPIO
+// output when its PxINT and PxPAT1 bits are clear and its PxMSK bit is set,
+// and its level is then PxPAT0, which has write-one set and clear aliases,
+// so any number of pins of a port change with one store per direction and
+// no syscall at all.
+//
+// The lines are still claimed through the character device first: the
+// kernel makes them outputs and refuses lines someone else holds, and the
+// request stays open so nobody can take them while they are driven here.
+// Pins are then checked against the port's function registers and stores
+// are masked to the checked pins.
+//
+// The register block can also be a regular file laid out like the ports, in
+// which case nothing is claimed and the stores can be read back from it.
+
+#define INGENIC_GPIO_BASE  0x10010000
+#define INGENIC_PORT_SIZE  0x1000
+#define INGENIC_PORTS      6
+#define GPIO_LINES_PER_PORT 32
+
+// Word offsets within a port
+#define PXINT   (0x10 / 4)
+#define PXMSK   (0x20 / 4)
+#define PXPAT1  (0x30 / 4)
+#define PXPAT0  (0x40 / 4)
+#define PXPAT0S (0x44 / 4)
+#define PXPAT0C (0x48 / 4)
+
+#define MMIO_LINE_SETS 4
+
+const char *gpio_mmio_path = "/dev/mem";
+
+static struct gpio_regs regs = { .fd = -1 };
+
+// Pins of each port driven here, stores never touch anything else
+static uint32_t port_mask[INGENIC_PORTS];
+static int claim_fds[INGENIC_PORTS * MMIO_LINE_SETS];  // Line requests held open
+static int claim_count;
+
+int gpio_regs_map(struct gpio_regs *r, const char *path) {
+	struct stat st;
+	off_t offset = 0;
+
+	r->len = INGENIC_PORTS * INGENIC_PORT_SIZE;
+	r->fd = open(path, O_RDWR | O_SYNC | O_CLOEXEC);
+	if (r->fd < 0) {
+		syslog(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
+		return -1;
+	}
+	if (fstat(r->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		r->file = 1;
+		if (st.st_size < (off_t)r->len) {
+			syslog(LOG_ERR, "%s is smaller than the GPIO register block", path);
+			close(r->fd);
+			r->fd = -1;
+			return -1;
+		}
+	} else {
+		r->file = 0;
+		offset = INGENIC_GPIO_BASE;
+	}
+
+	void *map = mmap(NULL, r->len, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, offset);
+	if (map == MAP_FAILED) {
+		syslog(LOG_ERR, "Failed to map GPIO registers from %s: %s", path, strerror(errno));
+		close(r->fd);
+		r->fd = -1;
+		return -1;
+	}
+	r->base = map;
+	return 0;
+}
+
+void gpio_regs_unmap(struct gpio_regs *r) {
+	if (r->fd < 0) {
+		return;
+	}
+	munmap((void *)r->base, r->len);
+	close(r->fd);
+	r->fd = -1;
+}
+
+static volatile uint32_t *gpio_regs_port(const struct gpio_regs *r, int port) {
+	return r->base + port * (INGENIC_PORT_SIZE / 4);
+}
+
+// Mask of the pins in "want" that are configured as GPIO outputs
+uint32_t gpio_regs_outputs(const struct gpio_regs *r, int port, uint32_t want) {
+	volatile uint32_t *p = gpio_regs_port(r, port);
+	return want & ~p[PXINT] & p[PXMSK] & ~p[PXPAT1];
+}
+
+void gpio_regs_write(const struct gpio_regs *r, int port, uint32_t set, uint32_t clear) {
+	volatile uint32_t *p = gpio_regs_port(r, port);
+	if (set) {
+		p[PXPAT0S] = set;
+	}
+	if (clear) {
+		p[PXPAT0C] = clear;
+	}
+}
+
+uint32_t gpio_regs_read(const struct gpio_regs *r, int port) {
+	return gpio_regs_port(r, port)[PXPAT0];
+}
+
+static void mmio_release_all(void) {
+	for (int i = 0; i < claim_count; i++) {
+		close(claim_fds[i]);
+	}
+	claim_count = 0;
+	memset(port_mask, 0, sizeof(port_mask));
+	gpio_regs_unmap(&regs);
+}
+
+// Give back the claims made since claim_count was count and port_mask was
+// mask, after a request failed part way
+static void mmio_unclaim(int count, const uint32_t *mask) {
+	while (claim_count > count) {
+		close(claim_fds[--claim_count]);
+	}
+	memcpy(port_mask, mask, sizeof(port_mask));
+}
+
+// Claim and check the pins of one port, adding them to the port's mask.
+// The request carries the pins' polarity (low, a mask of active low pins)
+// so every line starts out off. Nothing is kept on failure.
+static int mmio_claim(int port, uint32_t pins, uint32_t low) {
+	int gpios[GPIO_LINES_PER_PORT];
+	int active_low[GPIO_LINES_PER_PORT];
+	int n = 0;
+
+	if (port >= INGENIC_PORTS) {
+		syslog(LOG_ERR, "GPIO port %d is out of range", port);
+		return -1;
+	}
+	if (port_mask[port] & pins) {
+		syslog(LOG_ERR, "GPIO port %d: pins 0x%08x are already in use", port,
+		       (unsigned int)(port_mask[port] & pins));
+		return -1;
+	}
+
+	if (!regs.file) {
+		for (int pin = 0; pin < GPIO_LINES_PER_PORT; pin++) {
+			if (pins & (1U << pin)) {
+				active_low[n] = (low >> pin) & 1;
+				gpios[n++] = port * GPIO_LINES_PER_PORT + pin;
+			}
+		}
+		int fd = claim_count < INGENIC_PORTS * MMIO_LINE_SETS ?
+		         gpio_request_outputs(gpios, active_low, n) : -1;
+		if (fd < 0) {
+			return -1;
+		}
+		claim_fds[claim_count++] = fd;
+	}
+
+	uint32_t ok = gpio_regs_outputs(&regs, port, pins);
+	if (ok != pins) {
+		syslog(LOG_ERR, "GPIO port %d: pins 0x%08x are not GPIO outputs", port,
+		       (unsigned int)(pins & ~ok));
+		if (!regs.file) {
+			close(claim_fds[--claim_count]);
+		}
+		return -1;
+	}
+	port_mask[port] |= pins;
+	return 0;
+}
+
+static int mmio_map(void) {
+	if (regs.fd >= 0) {
+		return 0;
+	}
+	return gpio_regs_map(&regs, gpio_mmio_path);
+}
+
+static int mmio_open(struct led *leds, int count) {
+	uint32_t pins[INGENIC_PORTS] = { 0 };
+	uint32_t low[INGENIC_PORTS] = { 0 };
+
+	if (mmio_map() == -1) {
+		return -1;
+	}
+	for (int i = 0; i < count; i++) {
+		int port = leds[i].gpio / GPIO_LINES_PER_PORT;
+		if (leds[i].gpio < 0 || port >= INGENIC_PORTS) {
+			syslog(LOG_ERR, "GPIO %d is out of range", leds[i].gpio);
+			mmio_release_all();
+			return -1;
+		}
+		leds[i].req = port;
+		leds[i].bit = leds[i].gpio % GPIO_LINES_PER_PORT;
+		pins[port] |= 1U << leds[i].bit;
+		if (leds[i].active_low) {
+			low[port] |= 1U << leds[i].bit;
+		}
+	}
+	for (int port = 0; port < INGENIC_PORTS; port++) {
+		if (pins[port] && mmio_claim(port, pins[port], low[port]) == -1) {
+			mmio_release_all();
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int mmio_write(struct led *leds, int count) {
+	uint32_t set[INGENIC_PORTS] = { 0 };
+	uint32_t clear[INGENIC_PORTS] = { 0 };
+
+	for (int i = 0; i < count; i++) {
+		if (!leds[i].dirty) {
+			continue;
+		}
+		leds[i].dirty = 0;
+		int high = (leds[i].level != LEVEL_OFF) ^ leds[i].active_low;
+		if (high) {
+			set[leds[i].req] |= 1U << leds[i].bit;
+		} else {
+			clear[leds[i].req] |= 1U << leds[i].bit;
+		}
+	}
+
+	for (int port = 0; port < INGENIC_PORTS; port++) {
+		gpio_regs_write(&regs, port, set[port] & port_mask[port], clear[port] & port_mask[port]);
+	}
+	return 0;
+}
+
+static void mmio_close(struct led *leds, int count) {
+	(void)leds;
+	(void)count;
+	mmio_release_all();
+}
+
+const struct led_backend backend_mmio = {
+	.name = "mmio",
+	.caps = LED_CAP_SOFT_PWM,
+	.open = mmio_open,
+	.write = mmio_write,
+	.close = mmio_close,
+};
+
+// Raw line sets on the registers, for the matrix scanner. A set may span
+// ports, each value change is then one store per port and direction.
+
+struct mmio_lines {
+	int count;
+	uint8_t port[MATRIX_MAX_LINES * 2];
+	uint8_t pin[MATRIX_MAX_LINES * 2];
+	uint8_t active_low[MATRIX_MAX_LINES * 2];
+};
+
+static struct mmio_lines mmio_lines[MMIO_LINE_SETS];
+static int mmio_line_count;
+
+static int mmio_lines_request(const int *gpios, const int *active_low, int count) {
+	uint32_t pins[INGENIC_PORTS] = { 0 };
+	uint32_t low[INGENIC_PORTS] = { 0 };
+	uint32_t mask[INGENIC_PORTS];
+	int claimed = claim_count;
+
+	if (mmio_line_count == MMIO_LINE_SETS || count > MATRIX_MAX_LINES * 2 || mmio_map() == -1) {
+		return -1;
+	}
+	struct mmio_lines *ml = &mmio_lines[mmio_line_count];
+	ml->count = count;
+	for (int i = 0; i < count; i++) {
+		if (gpios[i] < 0 || gpios[i] / GPIO_LINES_PER_PORT >= INGENIC_PORTS) {
+			syslog(LOG_ERR, "GPIO %d is out of range", gpios[i]);
+			return -1;
+		}
+		ml->port[i] = (uint8_t)(gpios[i] / GPIO_LINES_PER_PORT);
+		ml->pin[i] = (uint8_t)(gpios[i] % GPIO_LINES_PER_PORT);
+		ml->active_low[i] = (uint8_t)active_low[i];
+		pins[ml->port[i]] |= 1U << ml->pin[i];
+		if (active_low[i]) {
+			low[ml->port[i]] |= 1U << ml->pin[i];
+		}
+	}
+	memcpy(mask, port_mask, sizeof(mask));
+	for (int port = 0; port < INGENIC_PORTS; port++) {
+		if (pins[port] && mmio_claim(port, pins[port], low[port]) == -1) {
+			mmio_unclaim(claimed, mask);
+			return -1;
+		}
+	}
+	return mmio_line_count++;
+}
+
+static int mmio_lines_set(int handle, uint64_t mask, uint64_t bits) {
+	const struct mmio_lines *ml = &mmio_lines[handle];
+	uint32_t set[INGENIC_PORTS] = { 0 };
+	uint32_t clear[INGENIC_PORTS] = { 0 };
+
+	for (int i = 0; i < ml->count; i++) {
+		if (!(mask & (1ULL << i))) {
+			continue;
+		}
+		int high = ((bits >> i) & 1) ^ ml->active_low[i];
+		if (high) {
+			set[ml->port[i]] |= 1U << ml->pin[i];
+		} else {
+			clear[ml->port[i]] |= 1U << ml->pin[i];
+		}
+	}
+	for (int port = 0; port < INGENIC_PORTS; port++) {
+		gpio_regs_write(&regs, port, set[port] & port_mask[port], clear[port] & port_mask[port]);
+	}
+	return 0;
+}
+
+static void mmio_lines_release(int handle) {
+	(void)handle;
+	if (--mmio_line_count == 0) {
+		mmio_release_all();
+	}
+}
+
+const struct line_ops lines_mmio = {
+	.name = "mmio",
+	.request = mmio_lines_request,
+	.set = mmio_lines_set,
+	.release = mmio_lines_release,
+};
@@ -0,0 +1,495 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ledd.h"
+
+// Easing curves sampled at 33 points over [0, 1], 65535 is 1.0. Values in
+// between are interpolated linearly, so evaluating a ramp is two table reads
+// and a multiply.
+#define EASE_LUT_BITS 5
+#define EASE_LUT_SIZE (1 << EASE_LUT_BITS)
+#define EASE_ONE 65535
+
+static const uint16_t ease_lut[EASE_COUNT][EASE_LUT_SIZE + 1] = {
+	[EASE_LINEAR] = {
+		    0,  2048,  4096,  6144,  8192, 10240, 12288, 14336,
+		16384, 18432, 20480, 22528, 24576, 26624, 28672, 30720,
+		32768, 34815, 36863, 38911, 40959, 43007, 45055, 47103,
+		49151, 51199, 53247, 55295, 57343, 59391, 61439, 63487,
+		65535,
+	},
+	[EASE_IN] = {
+		    0,    64,   256,   576,  1024,  1600,  2304,  3136,
+		 4096,  5184,  6400,  7744,  9216, 10816, 12544, 14400,
+		16384, 18496, 20736, 23104, 25600, 28224, 30976, 33855,
+		36863, 39999, 43263, 46655, 50175, 53823, 57599, 61503,
+		65535,
+	},
+	[EASE_OUT] = {
+		    0,  4032,  7936, 11712, 15360, 18880, 22272, 25536,
+		28672, 31680, 34559, 37311, 39935, 42431, 44799, 47039,
+		49151, 51135, 52991, 54719, 56319, 57791, 59135, 60351,
+		61439, 62399, 63231, 63935, 64511, 64959, 65279, 65471,
+		65535,
+	},
+	[EASE_IN_OUT] = {
+		    0,   188,   736,  1620,  2816,  4300,  6048,  8036,
+		10240, 12636, 15200, 17908, 20736, 23660, 26656, 29700,
+		32768, 35835, 38879, 41875, 44799, 47627, 50335, 52899,
+		55295, 57499, 59487, 61235, 62719, 63915, 64799, 65347,
+		65535,
+	},
+};
+
+static const char *const ease_names[EASE_COUNT] = {
+	[EASE_STEP] = "step",
+	[EASE_LINEAR] = "linear",
+	[EASE_IN] = "in",
+	[EASE_OUT] = "out",
+	[EASE_IN_OUT] = "inout",
+};
+
+// Every push gets a new sequence number so a re-pushed layer counts as a
+// change of the top layer
+static uint32_t layer_seq;
+
+// Eased fraction of elapsed / duration, 0..EASE_ONE
+static uint32_t ease_apply(enum ease e, uint32_t elapsed, uint32_t duration) {
+	if (elapsed >= duration) {
+		return EASE_ONE;
+	}
+
+	uint32_t t = (uint32_t)(((uint64_t)elapsed << 16) / duration);
+	uint32_t idx = t >> (16 - EASE_LUT_BITS);
+	uint32_t frac = t & ((1 << (16 - EASE_LUT_BITS)) - 1);
+	uint32_t a = ease_lut[e][idx];
+	uint32_t b = ease_lut[e][idx + 1];
+	return a + (((b - a) * frac) >> (16 - EASE_LUT_BITS));
+}
+
+static uint8_t blend(uint8_t from, uint8_t to, uint32_t e) {
+	return (uint8_t)((int)from + (((int)to - (int)from) * (int)e + EASE_ONE / 2) / EASE_ONE);
+}
+
+void pattern_solid(struct pattern *p, uint8_t level) {
+	p->ext = NULL;
+	p->nsteps = 1;
+	p->period = 0;
+	p->phase = 0;
+	p->steps[0] = (struct step){ level, 0, EASE_STEP, COLOR_INHERIT };
+}
+
+void pattern_blink(struct pattern *p, uint32_t on_ms, uint32_t off_ms) {
+	p->ext = NULL;
+	p->nsteps = 2;
+	p->steps[0] = (struct step){ LEVEL_ON, on_ms ? on_ms : 1, EASE_STEP, COLOR_INHERIT };
+	p->steps[1] = (struct step){ LEVEL_OFF, off_ms ? off_ms : 1, EASE_STEP, COLOR_INHERIT };
+	p->period = p->steps[0].ms + p->steps[1].ms;
+	p->phase = 0;
+}
+
+// Built in animations, step durations are in quarters of the interval
+static const struct {
+	const char *name;
+	int nsteps;
+	struct {
+		uint8_t level;
+		uint8_t quarters;
+		uint8_t ease;
+	} steps[5];
+} builtins[] = {
+	{ "breathe", 2, { { 255, 4, EASE_IN_OUT }, { 0, 4, EASE_IN_OUT } } },
+	{ "pulse", 3, { { 255, 1, EASE_OUT }, { 0, 4, EASE_IN }, { 0, 3, EASE_STEP } } },
+	{ "heartbeat", 5, { { 255, 1, EASE_OUT }, { 0, 1, EASE_IN }, { 255, 1, EASE_OUT },
+	                    { 0, 1, EASE_IN }, { 0, 4, EASE_STEP } } },
+};
+
+static int parse_keyframes(const char *spec, struct pattern *p) {
+	char buf[PATTERN_SPEC_MAX];
+	char *save = NULL;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	p->ext = NULL;
+	p->nsteps = 0;
+	p->period = 0;
+	p->phase = 0;
+
+	// <level>[@<color>]:<ms>[:<ease>], comma separated
+	for (char *tok = strtok_r(buf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+		if (p->nsteps == PATTERN_MAX_STEPS) {
+			return -1;
+		}
+
+		struct step *st = &p->steps[p->nsteps];
+		char *end;
+		long level = strtol(tok, &end, 10);
+		if (end == tok || level < 0 || level > LEVEL_ON) {
+			return -1;
+		}
+		st->level = (uint8_t)level;
+		st->color = COLOR_INHERIT;
+		st->ease = EASE_STEP;
+
+		if (*end == '@') {
+			char *colon = strchr(end, ':');
+			if (colon == NULL) {
+				return -1;
+			}
+			*colon = '\0';
+			int color = color_lookup(end + 1);
+			if (color == -1) {
+				return -1;
+			}
+			st->color = (uint8_t)color;
+			*colon = ':';
+			end = colon;
+		}
+		if (*end != ':') {
+			return -1;
+		}
+
+		char *ms_end;
+		unsigned long ms = strtoul(end + 1, &ms_end, 10);
+		if (ms_end == end + 1 || ms == 0 || ms > 3600000) {
+			return -1;
+		}
+		st->ms = (uint32_t)ms;
+
+		if (*ms_end == ':') {
+			int e;
+			for (e = 0; e < EASE_COUNT; e++) {
+				if (strcmp(ms_end + 1, ease_names[e]) == 0) {
+					break;
+				}
+			}
+			if (e == EASE_COUNT) {
+				return -1;
+			}
+			st->ease = (uint8_t)e;
+		} else if (*ms_end != '\0') {
+			return -1;
+		}
+
+		p->period += st->ms;
+		p->nsteps++;
+	}
+
+	return p->nsteps > 0 ? 0 : -1;
+}
+
+// Parse "blink", a built in animation name or a keyframe list. The interval
+// sets the timing of the named patterns.
+int pattern_parse(const char *spec, uint32_t interval_ms, struct pattern *p) {
+	if (interval_ms == 0) {
+		interval_ms = 1;
+	}
+
+	if (strcmp(spec, "blink") == 0) {
+		pattern_blink(p, interval_ms, interval_ms);
+		return 0;
+	}
+
+	for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+		if (strcmp(spec, builtins[i].name) != 0) {
+			continue;
+		}
+		p->ext = NULL;
+		p->nsteps = builtins[i].nsteps;
+		p->period = 0;
+		p->phase = 0;
+		for (int j = 0; j < p->nsteps; j++) {
+			uint32_t ms = interval_ms * builtins[i].steps[j].quarters / 4;
+			p->steps[j] = (struct step){ builtins[i].steps[j].level, ms ? ms : 1,
+			                             builtins[i].steps[j].ease, COLOR_INHERIT };
+			p->period += p->steps[j].ms;
+		}
+		return 0;
+	}
+
+	return parse_keyframes(spec, p);
+}
+
+int pattern_colored(const struct pattern *p) {
+	const struct step *steps = p->ext ? p->ext : p->steps;
+	for (int i = 0; i < p->nsteps; i++) {
+		if (steps[i].color != COLOR_INHERIT) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Morse for digits, letters and a few separators, '.' dot and '-' dash
+static const char *const morse_digits[] = {
+	"-----", ".----", "..---", "...--", "....-", ".....", "-....", "--...", "---..", "----.",
+};
+static const char *const morse_letters[] = {
+	".-", "-...", "-.-.", "-..", ".", "..-.", "--.", "....", "..", ".---", "-.-", ".-..", "--",
+	"-.", "---", ".--.", "--.-", ".-.", "...", "-", "..-", "...-", ".--", "-..-", "-.--", "--..",
+};
+
+static const char *morse_lookup(char c) {
+	if (c >= '0' && c <= '9') {
+		return morse_digits[c - '0'];
+	}
+	if (c >= 'a' && c <= 'z') {
+		c = (char)(c - 'a' + 'A');
+	}
+	if (c >= 'A' && c <= 'Z') {
+		return morse_letters[c - 'A'];
+	}
+	switch (c) {
+	case '.': return ".-.-.-";
+	case '-': return "-....-";
+	case ':': return "---...";
+	case '/': return "-..-.";
+	default: return NULL;
+	}
+}
+
+// Append units of a level, merging with the last step when it is the same
+static int readout_add(struct pattern *p, struct step *steps, int max, uint8_t level,
+                       uint32_t ms) {
+	p->period += ms;
+	if (p->nsteps > 0 && steps[p->nsteps - 1].level == level) {
+		steps[p->nsteps - 1].ms += ms;
+		return 0;
+	}
+	if (p->nsteps == max) {
+		return -1;
+	}
+	steps[p->nsteps++] = (struct step){ level, ms, EASE_STEP, COLOR_INHERIT };
+	return 0;
+}
+
+// Compile text into the caller's step array as one cycle of a readout,
+// played like any other pattern. Blink codes show each digit as that many
+// short flashes (ten for 0) and any separator as one long flash. Morse
+// uses the usual 1:3:7 timing. Cycles start and end dark so repeats are
+// easy to tell apart. Returns -1 for text the mode cannot show or that
+// does not fit.
+int pattern_readout(struct pattern *p, struct step *steps, int max, const char *text,
+                    enum readout_mode mode, uint32_t unit_ms) {
+	int ret = 0;
+
+	p->ext = steps;
+	p->nsteps = 0;
+	p->period = 0;
+	p->phase = 0;
+	if (*text == '\0') {
+		return -1;
+	}
+
+	ret |= readout_add(p, steps, max, LEVEL_OFF, unit_ms * 4);
+	for (const char *c = text; *c != '\0' && ret == 0; c++) {
+		if (mode == READOUT_BLINK) {
+			int flashes = *c >= '1' && *c <= '9' ? *c - '0' : *c == '0' ? 10 : 0;
+			if (flashes == 0 && strchr(".-:/ ", *c) == NULL) {
+				return -1;
+			}
+			for (int i = 0; i < flashes; i++) {
+				ret |= readout_add(p, steps, max, LEVEL_ON, unit_ms);
+				ret |= readout_add(p, steps, max, LEVEL_OFF, unit_ms);
+			}
+			if (flashes == 0) {
+				ret |= readout_add(p, steps, max, LEVEL_ON, unit_ms * 4);
+				ret |= readout_add(p, steps, max, LEVEL_OFF, unit_ms);
+			}
+			ret |= readout_add(p, steps, max, LEVEL_OFF, unit_ms * 2);
+		} else if (*c == ' ') {
+			ret |= readout_add(p, steps, max, LEVEL_OFF, unit_ms * 4);
+		} else {
+			const char *code = morse_lookup(*c);
+			if (code == NULL) {
+				return -1;
+			}
+			for (; *code != '\0'; code++) {
+				ret |= readout_add(p, steps, max, LEVEL_ON, *code == '-' ? unit_ms * 3 : unit_ms);
+				ret |= readout_add(p, steps, max, LEVEL_OFF, unit_ms);
+			}
+			ret |= readout_add(p, steps, max, LEVEL_OFF, unit_ms * 2);
+		}
+	}
+	return ret;
+}
+
+// Level of a pattern started at "epoch", and the time it next changes. A
+// ramp step moves from the previous step's level to its own; with frame_ms
+// at 0 the output only takes keyframes, so a ramp jumps straight to its
+// target, otherwise frames come at most every frame_ms.
+static uint8_t pattern_eval(const struct pattern *p, uint64_t epoch, uint64_t now,
+                            uint32_t frame_ms, uint64_t *next) {
+	const struct step *steps = p->ext ? p->ext : p->steps;
+
+	if (p->period == 0) {
+		*next = 0;
+		return steps[0].level;
+	}
+
+	uint64_t elapsed = now - epoch + p->phase;
+	uint32_t pos = (uint32_t)(elapsed % p->period);
+	uint32_t start = 0;
+	for (int i = 0; i < p->nsteps; i++) {
+		const struct step *st = &steps[i];
+		uint32_t end = start + st->ms;
+		if (pos >= end) {
+			start = end;
+			continue;
+		}
+
+		*next = now + (end - pos);
+		if (st->ease == EASE_STEP || frame_ms == 0) {
+			return st->level;
+		}
+
+		uint8_t from = steps[i > 0 ? i - 1 : p->nsteps - 1].level;
+		if (frame_ms < end - pos) {
+			*next = now + frame_ms;
+		}
+		return blend(from, st->level, ease_apply((enum ease)st->ease, pos - start, st->ms));
+	}
+
+	// Not reached, the step durations always add up to the period
+	*next = now + (p->period - pos);
+	return steps[p->nsteps - 1].level;
+}
+
+static void layer_remove(struct layer_stack *s, int index) {
+	s->depth--;
+	memmove(&s->layers[index], &s->layers[index + 1],
+	        (size_t)(s->depth - index) * sizeof(s->layers[0]));
+}
+
+void layer_pop(struct layer_stack *s, int id) {
+	for (int i = 0; i < s->depth; i++) {
+		if (s->layers[i].id == id) {
+			layer_remove(s, i);
+			return;
+		}
+	}
+}
+
+const struct layer *layer_top(const struct layer_stack *s) {
+	return s->depth > 0 ? &s->layers[s->depth - 1] : NULL;
+}
+
+// The stack is kept ordered by priority, a layer pushed at the same priority
+// as existing ones goes on top of them. Pushing an id that is already on the
+// stack replaces it.
+int layer_push(struct layer_stack *s, int id, enum layer_prio prio, const struct pattern *p,
+               uint64_t now, uint32_t duration_ms) {
+	layer_pop(s, id);
+	if (s->depth == LAYER_STACK_MAX) {
+		return -1;
+	}
+
+	int i = s->depth;
+	while (i > 0 && s->layers[i - 1].prio > prio) {
+		i--;
+	}
+	memmove(&s->layers[i + 1], &s->layers[i], (size_t)(s->depth - i) * sizeof(s->layers[0]));
+	s->depth++;
+
+	struct layer *l = &s->layers[i];
+	l->id = id;
+	l->prio = prio;
+	l->seq = ++layer_seq;
+	l->pattern = *p;
+	l->epoch = now;
+	l->expires = duration_ms ? now + duration_ms : 0;
+	l->synced = 0;
+	l->slew = 0;
+	return 0;
+}
+
+// Align the layer's cycle to "wall", the wall clock in ms at its epoch, so
+// every device showing the same pattern starts its cycles together
+void layer_sync(struct layer_stack *s, int id, uint64_t wall) {
+	for (int i = 0; i < s->depth; i++) {
+		struct layer *l = &s->layers[i];
+		if (l->id == id && l->pattern.period > 0) {
+			l->pattern.phase = (uint32_t)((l->pattern.phase + wall) % l->pattern.period);
+			l->synced = 1;
+		}
+	}
+}
+
+// The wall clock moved by delta_ms against the monotonic one. Synced layers
+// take the shortest way to the new phase, a bit at every evaluation, so a
+// clock step does not make the LEDs jump.
+void layer_retime(struct layer_stack *s, int64_t delta_ms) {
+	for (int i = 0; i < s->depth; i++) {
+		struct layer *l = &s->layers[i];
+		if (!l->synced) {
+			continue;
+		}
+		int64_t period = l->pattern.period;
+		int64_t d = ((l->slew + delta_ms) % period + period) % period;
+		l->slew = (int32_t)(d > period / 2 ? d - period : d);
+	}
+}
+
+// Apply up to a sixteenth of the period of pending correction
+static void layer_slew(struct layer_stack *s) {
+	for (int i = 0; i < s->depth; i++) {
+		struct layer *l = &s->layers[i];
+		if (l->slew == 0) {
+			continue;
+		}
+		int32_t max = (int32_t)(l->pattern.period / 16) + 1;
+		int32_t step = l->slew > max ? max : l->slew < -max ? -max : l->slew;
+		l->pattern.phase = (uint32_t)(((int64_t)l->pattern.phase + step + l->pattern.period) %
+		                              l->pattern.period);
+		l->slew -= step;
+	}
+}
+
+// Drop expired layers and evaluate the topmost one. Lower layers keep their
+// own epoch, so once an overlay expires they resume at the phase they would
+// have had if they had been visible all along. When the top layer changes
+// and the output can dim, the new level is crossfaded in over fade_ms.
+uint8_t layer_eval(struct layer_stack *s, uint64_t now, uint32_t frame_ms, uint32_t fade_ms,
+                   uint64_t *next) {
+	for (int i = s->depth - 1; i >= 0; i--) {
+		if (s->layers[i].expires && now >= s->layers[i].expires) {
+			layer_remove(s, i);
+		}
+	}
+	layer_slew(s);
+
+	uint8_t level = LEVEL_OFF;
+	uint32_t seq = 0;
+	*next = 0;
+	if (s->depth > 0) {
+		const struct layer *top = &s->layers[s->depth - 1];
+		level = pattern_eval(&top->pattern, top->epoch, now, frame_ms, next);
+		if (top->expires && (*next == 0 || top->expires < *next)) {
+			*next = top->expires;
+		}
+		seq = top->seq;
+	}
+
+	if (seq != s->top_seq) {
+		s->top_seq = seq;
+		if (frame_ms && fade_ms) {
+			s->fade_from = s->level;
+			s->fade_start = now;
+			s->fading = 1;
+		}
+	}
+	if (s->fading) {
+		uint32_t elapsed = (uint32_t)(now - s->fade_start);
+		if (elapsed >= fade_ms) {
+			s->fading = 0;
+		} else {
+			level = blend(s->fade_from, level, ease_apply(EASE_IN_OUT, elapsed, fade_ms));
+			if (*next == 0 || now + frame_ms < *next) {
+				*next = now + frame_ms;
+			}
+		}
+	}
+
+	s->level = level;
+	return level;
+}
@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+
+#include "ledd.h"
+
+// Simulation: the daemon runs its real loop against a virtual clock and a
+// backend that prints every level it is handed. Sleeping jumps the clock to
+// the next deadline or scripted event, so hours of patterns take
+// milliseconds and the printed edge trace is the same on every run.
+//
+// The script has one directive per line, '#' starts a comment:
+//
+//   led <name> [<name>...]   LEDs, in gpio_led_* order
+//   pwm                      Outputs take levels, like the I2C and SPI backends
+//   <ms> create [<text>]     Create the monitored file with <text> as its line
+//   <ms> remove              Remove the monitored file
+//   <ms> signal <term|int>   Deliver a signal to the daemon
+//   <ms> end                 Stop the simulation
+//
+// Times are milliseconds since the start and must not decrease.
+
+#define SIM_EVENTS_MAX 256
+#define SIM_TEXT_MAX   64
+#define SIM_START_MS   1000  // Virtual clock at the start, deadlines of 0 mean none
+
+enum sim_action {
+	SIM_CREATE,
+	SIM_REMOVE,
+	SIM_SIGNAL,
+	SIM_END,
+};
+
+struct sim_event {
+	uint64_t at;
+	enum sim_action action;
+	int sig;
+	char text[SIM_TEXT_MAX];
+};
+
+static struct sim_event events[SIM_EVENTS_MAX];
+static int event_count;
+static int next_event;
+static const char *sim_file;
+static char sim_dir[] = "/tmp/ledd-sim.XXXXXX";  // Private home of the default file
+static char sim_path[sizeof(sim_dir) + 8];
+static int sim_dir_made;
+
+int sim_active;
+int sim_pwm;
+uint64_t sim_now;
+struct sim_stats sim_stats;
+
+static int sim_add_leds(char *names, struct led *leds, int count) {
+	char *save = NULL;
+	for (char *name = strtok_r(names, " \t\n", &save); name != NULL;
+	     name = strtok_r(NULL, " \t\n", &save)) {
+		if (count == MAX_LEDS) {
+			return -1;
+		}
+		struct led *led = &leds[count];
+		memset(led, 0, sizeof(*led));
+		snprintf(led->name, sizeof(led->name), "%s", name);
+		led->gpio = count;
+		count++;
+	}
+	return count;
+}
+
+static int sim_add_event(uint64_t at, char *rest) {
+	struct sim_event *ev = &events[event_count];
+	char *arg;
+
+	if (event_count == SIM_EVENTS_MAX || (event_count > 0 && at < events[event_count - 1].at)) {
+		return -1;
+	}
+	memset(ev, 0, sizeof(*ev));
+	ev->at = at;
+	rest += strspn(rest, " \t");
+	arg = rest + strcspn(rest, " \t\n");
+	if (*arg != '\0') {
+		*arg++ = '\0';
+		arg += strspn(arg, " \t");
+		arg[strcspn(arg, "\n")] = '\0';
+	}
+
+	if (strcmp(rest, "create") == 0) {
+		ev->action = SIM_CREATE;
+		snprintf(ev->text, sizeof(ev->text), "%s", arg);
+	} else if (strcmp(rest, "remove") == 0) {
+		ev->action = SIM_REMOVE;
+	} else if (strcmp(rest, "signal") == 0) {
+		ev->action = SIM_SIGNAL;
+		snprintf(ev->text, sizeof(ev->text), "%s", arg);
+		if (strcmp(arg, "term") == 0) {
+			ev->sig = SIGTERM;
+		} else if (strcmp(arg, "int") == 0) {
+			ev->sig = SIGINT;
+		} else {
+			return -1;
+		}
+	} else if (strcmp(rest, "end") == 0) {
+		ev->action = SIM_END;
+	} else {
+		return -1;
+	}
+	event_count++;
+	return 0;
+}
+
+// Read the script, returns the number of LEDs or -1. Without a file (NULL
+// in *file) the simulation gets one in a private directory, since it
+// creates and removes the file at will and must not touch the live one.
+int sim_load(const char *script, const char **file, struct led *leds) {
+	char line[MAX_BUF * 2];
+	int count = 0;
+	int lineno = 0;
+
+	FILE *fp = fopen(script, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Failed to open %s\n", script);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char *p = line + strspn(line, " \t");
+		char *end;
+		lineno++;
+		p[strcspn(p, "#")] = '\0';
+		if (p[strspn(p, " \t\n")] == '\0') {
+			continue;
+		}
+
+		int ret = 0;
+		if (strncmp(p, "led ", 4) == 0) {
+			ret = count = sim_add_leds(p + 4, leds, count);
+		} else if (strncmp(p, "pwm", 3) == 0) {
+			sim_pwm = 1;
+		} else {
+			uint64_t at = strtoull(p, &end, 10);
+			ret = end == p ? -1 : sim_add_event(at + SIM_START_MS, end);
+		}
+		if (ret == -1) {
+			fprintf(stderr, "%s:%d: invalid line\n", script, lineno);
+			fclose(fp);
+			return -1;
+		}
+	}
+	fclose(fp);
+
+	if (*file == NULL) {
+		if (mkdtemp(sim_dir) == NULL) {
+			fprintf(stderr, "Failed to create %s\n", sim_dir);
+			return -1;
+		}
+		sim_dir_made = 1;
+		snprintf(sim_path, sizeof(sim_path), "%s/boot", sim_dir);
+		*file = sim_path;
+	}
+	sim_file = *file;
+	sim_now = SIM_START_MS;
+	sim_active = 1;
+	unlink(sim_file);
+	return count;
+}
+
+static void sim_run_event(const struct sim_event *ev) {
+	static const char *const names[] = {
+		[SIM_CREATE] = "create",
+		[SIM_REMOVE] = "remove",
+		[SIM_SIGNAL] = "signal",
+		[SIM_END] = "end",
+	};
+
+	printf("%llu %s%s%s\n", (unsigned long long)(ev->at - SIM_START_MS), names[ev->action],
+	       ev->text[0] ? " " : "", ev->text);
+
+	switch (ev->action) {
+	case SIM_CREATE: {
+		FILE *fp = fopen(sim_file, "w");
+		if (fp != NULL) {
+			fprintf(fp, "%s\n", ev->text);
+			fclose(fp);
+		}
+		break;
+	}
+	case SIM_REMOVE:
+		unlink(sim_file);
+		break;
+	case SIM_SIGNAL:
+		raise(ev->sig);
+		break;
+	case SIM_END:
+		raise(SIGTERM);
+		break;
+	}
+}
+
+// Stand-in for poll(): jump to the deadline, or to the next event if that
+// comes first and run it. The simulation ends after the last event.
+void sim_sleep(uint64_t deadline) {
+	sim_stats.wakeups++;
+	if (next_event == event_count) {
+		raise(SIGTERM);
+		return;
+	}
+	if (deadline != 0 && deadline < events[next_event].at) {
+		if (deadline > sim_now) {
+			sim_now = deadline;
+		}
+		return;
+	}
+	sim_now = events[next_event].at;
+	while (next_event < event_count && events[next_event].at == sim_now) {
+		sim_run_event(&events[next_event++]);
+	}
+}
+
+void sim_finish(void) {
+	printf("# %llu ms simulated, %lu wakeups, %lu writes, %.3f ms CPU\n",
+	       (unsigned long long)(sim_now - SIM_START_MS), sim_stats.wakeups, sim_stats.writes,
+	       (double)clock() * 1000.0 / CLOCKS_PER_SEC);
+	unlink(sim_file);
+	if (sim_dir_made) {
+		rmdir(sim_dir);
+	}
+}
+
+// The backend prints one "<ms> <led> <level>" line per level handed to it
+
+static int sim_open(struct led *leds, int count) {
+	(void)leds;
+	(void)count;
+	return 0;
+}
+
+static int sim_write(struct led *leds, int count) {
+	sim_stats.writes++;
+	for (int i = 0; i < count; i++) {
+		if (!leds[i].dirty) {
+			continue;
+		}
+		leds[i].dirty = 0;
+		printf("%llu %s %u\n", (unsigned long long)(sim_now - SIM_START_MS), leds[i].name,
+		       (unsigned int)leds[i].level);
+	}
+	return 0;
+}
+
+static void sim_close(struct led *leds, int count) {
+	(void)leds;
+	(void)count;
+}
+
+const struct led_backend backend_sim = {
+	.name = "sim",
+	.caps = LED_CAP_SOFT_PWM,
+	.open = sim_open,
+	.write = sim_write,
+	.close = sim_close,
+};
+
+const struct led_backend backend_sim_pwm = {
+	.name = "sim-pwm",
+	.caps = LED_CAP_PWM,
+	.frame_ms = 20,
+	.open = sim_open,
+	.write = sim_write,
+	.close = sim_close,
+};
@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ledd.h"
+
+// Boot stages as a state machine read from a config file. Each state names
+// what the status LED shows in it, each rule moves from a state to another
+// on an event, optionally guarded by the first word of the monitored file.
+// The rules are compiled into a table indexed by (state, event) whose cells
+// hold their candidate rules in file order, so dispatch goes straight to
+// the few rules that can apply and the first one whose guard holds wins.
+//
+// One directive per line, '#' starts a comment:
+//
+//   state <name> off|file|<pattern> [<interval s>] [<color>]
+//   <state>|* <event> [<word>] -> <state>
+//
+// "file" takes the interval, color and pattern from the monitored file like
+// the daemon does without a config. Events are present, changed, absent,
+// short and long. Patterns are checked like -p checks them when the config
+// is loaded. States are declared before the rules naming them, the
+// first one is the initial state. Entering a state, again or not, shows its
+// pattern from the start.
+
+static const char *const event_names[] = {
+	[STAGE_PRESENT] = "present",
+	[STAGE_CHANGED] = "changed",
+	[STAGE_ABSENT] = "absent",
+	[STAGE_SHORT] = "short",
+	[STAGE_LONG] = "long",
+};
+
+// Without a config: blink while the file exists, as set in it
+static const char *const default_lines[] = {
+	"state idle off",
+	"state boot file",
+	"idle present -> boot",
+	"idle changed -> boot",
+	"boot changed -> boot",
+	"boot absent -> idle",
+};
+
+// Rules as parsed, before they are grouped into cells
+struct stage_src {
+	int from;  // -1 for any state
+	int to;
+	enum stage_event event;
+	char guard[STAGE_NAME_MAX];
+};
+
+static struct stage_src srcs[STAGE_MAX_RULES];
+static int nsrcs;
+
+static int stage_lookup(const struct stage_machine *m, const char *name) {
+	for (int i = 0; i < m->nstates; i++) {
+		if (strcmp(m->states[i].name, name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int stage_add_state(struct stage_machine *m, char *args) {
+	struct stage_state *st = &m->states[m->nstates];
+	char *save = NULL;
+	char *name = strtok_r(args, " \t\n", &save);
+	char *spec = strtok_r(NULL, " \t\n", &save);
+	char *tok;
+
+	if (name == NULL || spec == NULL || m->nstates == STAGE_MAX_STATES ||
+	    strlen(name) >= sizeof(st->name) || strlen(spec) >= sizeof(st->spec) ||
+	    strcmp(name, "*") == 0 || stage_lookup(m, name) != -1) {
+		return -1;
+	}
+	if (strcmp(spec, "off") != 0 && strcmp(spec, "file") != 0 && !pattern_valid(spec)) {
+		return -1;
+	}
+	memset(st, 0, sizeof(*st));
+	snprintf(st->name, sizeof(st->name), "%s", name);
+	snprintf(st->spec, sizeof(st->spec), "%s", strcmp(spec, "off") == 0 ? "" : spec);
+	st->color = -1;
+	while ((tok = strtok_r(NULL, " \t\n", &save)) != NULL) {
+		char *end;
+		double secs = strtod(tok, &end);
+		if (*end == '\0' && secs > 0 && secs <= 3600) {
+			st->half_ms = (uint32_t)(secs * 1000);
+		} else if ((st->color = color_lookup(tok)) == -1) {
+			return -1;
+		}
+	}
+	m->nstates++;
+	return 0;
+}
+
+static int stage_add_rule(const struct stage_machine *m, char *line) {
+	struct stage_src *src = &srcs[nsrcs];
+	char *tok[6];
+	char *save = NULL;
+	int n = 0;
+
+	for (char *t = strtok_r(line, " \t\n", &save); t != NULL && n < 6;
+	     t = strtok_r(NULL, " \t\n", &save)) {
+		tok[n++] = t;
+	}
+	if (nsrcs == STAGE_MAX_RULES || n < 4 || n > 5 || strcmp(tok[n - 2], "->") != 0) {
+		return -1;
+	}
+	memset(src, 0, sizeof(*src));
+	src->from = strcmp(tok[0], "*") == 0 ? -1 : stage_lookup(m, tok[0]);
+	src->to = stage_lookup(m, tok[n - 1]);
+	src->event = STAGE_EVENT_COUNT;
+	for (int i = 0; i < STAGE_EVENT_COUNT; i++) {
+		if (strcmp(event_names[i], tok[1]) == 0) {
+			src->event = (enum stage_event)i;
+		}
+	}
+	if ((src->from == -1 && strcmp(tok[0], "*") != 0) || src->to == -1 ||
+	    src->event == STAGE_EVENT_COUNT || (n == 5 && strlen(tok[2]) >= sizeof(src->guard))) {
+		return -1;
+	}
+	if (n == 5) {
+		snprintf(src->guard, sizeof(src->guard), "%s", tok[2]);
+	}
+	nsrcs++;
+	return 0;
+}
+
+static int stage_line(struct stage_machine *m, char *line) {
+	char *p = line + strspn(line, " \t");
+
+	p[strcspn(p, "#")] = '\0';
+	if (p[strspn(p, " \t\n")] == '\0') {
+		return 0;
+	}
+	if (strncmp(p, "state ", 6) == 0) {
+		return stage_add_state(m, p + 6);
+	}
+	return stage_add_rule(m, p);
+}
+
+// Group the rules by (state, event), keeping file order within a cell,
+// with "*" rules standing in the cell of every state but their target, so
+// a polled file does not re-enter the state it keeps it in
+static int stage_compile(struct stage_machine *m) {
+	m->nrules = 0;
+	for (int s = 0; s < m->nstates; s++) {
+		for (int e = 0; e < STAGE_EVENT_COUNT; e++) {
+			m->first[s][e] = (uint8_t)m->nrules;
+			for (int i = 0; i < nsrcs; i++) {
+				if (srcs[i].event != (enum stage_event)e || (srcs[i].from != s &&
+				    (srcs[i].from != -1 || srcs[i].to == s))) {
+					continue;
+				}
+				if (m->nrules == STAGE_MAX_RULES) {
+					return -1;
+				}
+				struct stage_rule *r = &m->rules[m->nrules++];
+				r->to = (uint8_t)srcs[i].to;
+				snprintf(r->guard, sizeof(r->guard), "%s", srcs[i].guard);
+				m->guarded |= r->guard[0] != '\0';
+			}
+			m->count[s][e] = (uint8_t)(m->nrules - m->first[s][e]);
+		}
+	}
+	return 0;
+}
+
+// Read the config, or the built-in machine without one. Returns -1 after
+// reporting the offending line.
+int stage_load(struct stage_machine *m, const char *path) {
+	char line[PATTERN_SPEC_MAX + MAX_BUF];
+	int lineno = 0;
+
+	memset(m, 0, sizeof(*m));
+	nsrcs = 0;
+	if (path == NULL) {
+		for (size_t i = 0; i < sizeof(default_lines) / sizeof(default_lines[0]); i++) {
+			snprintf(line, sizeof(line), "%s", default_lines[i]);
+			stage_line(m, line);
+		}
+		return stage_compile(m);
+	}
+
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		if (stage_line(m, line) == -1) {
+			fprintf(stderr, "%s:%d: invalid line\n", path, lineno);
+			fclose(fp);
+			return -1;
+		}
+	}
+	fclose(fp);
+
+	if (m->nstates == 0 || stage_compile(m) == -1) {
+		fprintf(stderr, "%s: no states, or too many rules\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+const char *stage_event_name(enum stage_event ev) {
+	return event_names[ev];
+}
+
+// The state the event leads to, or -1 if no rule applies. Guards compare
+// with word, the first word of the monitored file (empty without one).
+int stage_next(const struct stage_machine *m, int state, enum stage_event ev, const char *word) {
+	const struct stage_rule *r = &m->rules[m->first[state][ev]];
+
+	for (int i = 0; i < m->count[state][ev]; i++, r++) {
+		if (r->guard[0] == '\0' || strcmp(r->guard, word) == 0) {
+			return r->to;
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../ledd.h"
+
+// I2C backend against the in-process mock: the init sequence, channel
+// changes coalescing into one burst, writes the register cache skips, and
+// blinks handed to the PCA9633 group blinker.
+
+#define PCA9685_LED(c) (0x06 + 4 * (c))  // ON_L, ON_H, OFF_L, OFF_H
+#define PCA9685_FULL   0x10
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+static void set_level(struct led *led, uint8_t level) {
+	led->level = level;
+	led->dirty = 1;
+}
+
+static void test_pca9685(void) {
+	struct led leds[MAX_LEDS];
+	struct i2c_stats before;
+
+	memset(i2c_mock_regs, 0xff, 0x46);
+	int count = i2c_parse("mock:0x40:pca9685:r,g,b", leds);
+	CHECK(count == 3);
+
+	// MODE1 on its own, then every register in one burst
+	before = i2c_stats;
+	CHECK(backend_i2c.open(leds, count) == 0);
+	CHECK(i2c_stats.bursts - before.bursts == 2);
+	CHECK(i2c_stats.bytes - before.bytes == 2 + 0x46 + 1);
+	CHECK(i2c_mock_regs[0x00] == 0x20);  // Auto-increment, not sleeping
+	CHECK(i2c_mock_regs[0x01] == 0x04);
+	for (int c = 0; c < 16; c++) {
+		CHECK(i2c_mock_regs[PCA9685_LED(c) + 3] == PCA9685_FULL);
+	}
+
+	// Three channels in one tick: one burst spanning them
+	before = i2c_stats;
+	set_level(&leds[0], LEVEL_ON);
+	set_level(&leds[1], 128);
+	set_level(&leds[2], LEVEL_OFF);
+	CHECK(backend_i2c.write(leds, count) == 0);
+	CHECK(i2c_stats.bursts - before.bursts == 1);
+	CHECK(i2c_stats.skipped == before.skipped);
+	CHECK(i2c_mock_regs[PCA9685_LED(0) + 1] == PCA9685_FULL);
+	CHECK(i2c_mock_regs[PCA9685_LED(0) + 3] == 0x0f);
+	CHECK(i2c_mock_regs[PCA9685_LED(1) + 1] == 0);
+	CHECK(i2c_mock_regs[PCA9685_LED(1) + 2] == 0x08);  // 128 of 255 is 2056 of 4095
+	CHECK(i2c_mock_regs[PCA9685_LED(1) + 3] == 0x08);
+	CHECK(i2c_mock_regs[PCA9685_LED(2) + 3] == PCA9685_FULL);
+	for (int i = 0; i < count; i++) {
+		CHECK(!leds[i].dirty);
+	}
+
+	// The same levels again: the cache keeps it off the bus
+	before = i2c_stats;
+	set_level(&leds[0], LEVEL_ON);
+	set_level(&leds[1], 128);
+	CHECK(backend_i2c.write(leds, count) == 0);
+	CHECK(i2c_stats.bursts == before.bursts);
+	CHECK(i2c_stats.bytes == before.bytes);
+	CHECK(i2c_stats.skipped - before.skipped == 1);
+
+	// One channel changing sends only its four registers
+	before = i2c_stats;
+	set_level(&leds[2], 64);
+	CHECK(backend_i2c.write(leds, count) == 0);
+	CHECK(i2c_stats.bursts - before.bursts == 1);
+	CHECK(i2c_stats.bytes - before.bytes <= 1 + 4);
+	CHECK(i2c_mock_regs[PCA9685_LED(2) + 3] == 0x04);
+
+	backend_i2c.close(leds, count);
+}
+
+static void test_pca9633(void) {
+	struct led leds[MAX_LEDS];
+	struct i2c_stats before;
+
+	memset(i2c_mock_regs, 0xff, 0x09);
+	int count = i2c_parse("mock:0x62:pca9633", leds);
+	CHECK(count == 4);
+
+	before = i2c_stats;
+	CHECK(backend_i2c.open(leds, count) == 0);
+	CHECK(i2c_stats.bursts - before.bursts == 2);
+	CHECK(i2c_mock_regs[0x00] == 0x00);  // Oscillator on
+	CHECK(i2c_mock_regs[0x08] == 0x00);  // Every channel off
+
+	// PWM and LEDOUT change together in one burst
+	before = i2c_stats;
+	set_level(&leds[0], 200);
+	set_level(&leds[3], LEVEL_ON);
+	CHECK(backend_i2c.write(leds, count) == 0);
+	CHECK(i2c_stats.bursts - before.bursts == 1);
+	CHECK(i2c_mock_regs[0x02] == 200);
+	CHECK(i2c_mock_regs[0x08] == (0x2 | 0x1 << 6));
+
+	before = i2c_stats;
+	set_level(&leds[0], 200);
+	CHECK(backend_i2c.write(leds, count) == 0);
+	CHECK(i2c_stats.skipped - before.skipped == 1);
+	CHECK(i2c_stats.bursts == before.bursts);
+
+	backend_i2c.close(leds, count);
+}
+
+// Offload a blink to the group blinker as update_leds does, then write
+static int offload(struct led *leds, int count, int i, uint32_t on_ms, uint32_t off_ms) {
+	struct pattern p;
+
+	pattern_blink(&p, on_ms, off_ms);
+	int hw = backend_i2c.offload(&leds[i], &p);
+	if (hw == 0) {
+		leds[i].hw_blink = 0;
+	}
+	leds[i].level = LEVEL_ON;
+	leds[i].dirty = 1;
+	CHECK(backend_i2c.write(leds, count) == 0);
+	return hw;
+}
+
+static void test_group_blink(void) {
+	struct led leds[MAX_LEDS];
+
+	int count = i2c_parse("mock:0x62:pca9633:r,g,b", leds);
+	CHECK(count == 3);
+	CHECK(backend_i2c.open(leds, count) == 0);
+
+	// 1 s period, half on: GRPFREQ counts 1/24 s, GRPPWM 1/256 of the period
+	CHECK(offload(leds, count, 0, 500, 500) == 2);
+	CHECK(leds[0].hw_blink);
+	CHECK(i2c_mock_regs[0x01] == (0x20 | 0x04));  // DMBLNK, OUTDRV
+	CHECK(i2c_mock_regs[0x07] == 23);
+	CHECK(i2c_mock_regs[0x06] == 128);
+	CHECK(i2c_mock_regs[0x02] == LEVEL_ON);
+	CHECK((i2c_mock_regs[0x08] & 0x3) == 0x3);  // LEDOUT: group controlled
+
+	// The same blink again needs nothing written
+	CHECK(offload(leds, count, 0, 500, 500) == 1);
+
+	// Re-timed while alone on the blinker
+	CHECK(offload(leds, count, 0, 200, 200) == 2);
+	CHECK(i2c_mock_regs[0x07] == 8);
+	CHECK(i2c_mock_regs[0x06] == 128);
+
+	// A second channel may join at the same timing, but not re-time it
+	CHECK(offload(leds, count, 1, 200, 200) == 2);
+	CHECK(offload(leds, count, 1, 500, 500) == 0);
+	CHECK(!leds[1].hw_blink);
+	CHECK(leds[0].hw_blink);
+	CHECK(i2c_mock_regs[0x07] == 8);
+
+	// Once the first channel leaves, the other may change it
+	leds[0].hw_blink = 0;
+	CHECK(offload(leds, count, 1, 500, 500) == 2);
+	CHECK(i2c_mock_regs[0x07] == 23);
+	CHECK(((i2c_mock_regs[0x08] >> 2) & 0x3) == 0x3);
+
+	backend_i2c.close(leds, count);
+}
+
+int main(void) {
+	test_pca9685();
+	test_pca9633();
+	test_group_blink();
+	printf("%s i2c\n", failures ? "FAIL" : "PASS");
+	return failures ? 1 : 0;
+}
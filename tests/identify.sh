@@ -0,0 +1,115 @@
+#!/bin/sh
+# UDP identify tests: the real daemon listens on loopback against the
+# in-process I2C mock, signed datagrams are sent to it and the identify
+# counters are read back from /metrics. A valid command must be accepted;
+# a forged MAC, a replay and a stale timestamp must be rejected; a flood
+# must be held to the token bucket; an over-long key must be refused.
+# Needs python3 to sign and send the datagrams, and curl.
+
+ledd=$(cd "$(dirname "$0")/.." && pwd)/ledd
+if ! command -v python3 >/dev/null || ! command -v curl >/dev/null; then
+	echo "SKIP identify: needs python3 and curl"
+	exit 0
+fi
+tmp=$(mktemp -d /tmp/ledd-test.XXXXXX) || exit 1
+port=$((47000 + $$ % 1000))
+failed=0
+
+now() {
+	python3 -c 'import time; print(int(time.time() * 1000))'
+}
+
+# <message>: the message with its HMAC appended
+sign() {
+	python3 -c 'import hashlib, hmac, sys
+key = open(sys.argv[1], "rb").read().rstrip(b"\r\n")
+print(sys.argv[2], hmac.new(key, sys.argv[2].encode(), hashlib.sha256).hexdigest())' "$tmp/key" "$1"
+}
+
+# Send each line of stdin as one datagram, a little apart so the small
+# receive buffer never overflows
+send() {
+	python3 -c 'import socket, sys, time
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+for line in sys.stdin:
+    s.sendto(line.rstrip("\n").encode(), ("127.0.0.1", int(sys.argv[1])))
+    time.sleep(0.002)' "$port"
+	sleep 0.3
+}
+
+metric() {
+	curl -s --unix-socket "$tmp/metrics" http://localhost/metrics | sed -n "s/^ledd_identify_$1_total //p"
+}
+
+# <name> <counter> <expected> [<most>]: the counter is expected, or in
+# expected..most
+expect() {
+	value=$(metric "$2")
+	if [ -n "$value" ] && [ "$value" -ge "$3" ] && [ "$value" -le "${4:-$3}" ]; then
+		echo "PASS $1: $2 $value"
+	else
+		echo "FAIL $1: $2 $value, expected $3${4:+ to $4}"
+		failed=1
+	fi
+}
+
+start() {
+	rm -f "$tmp/pid" "$tmp/metrics"
+	"$ledd" -L "$tmp/pid" -i mock:0x40:pca9685 -u "127.0.0.1:$port" -K "$tmp/key" \
+		-P "$tmp/metrics" 0.5 "$tmp/boot" 2>/dev/null
+	for i in 1 2 3 4 5 6 7 8 9 10; do
+		[ -S "$tmp/metrics" ] && return
+		sleep 0.1
+	done
+}
+
+stop() {
+	pid=$(cat "$tmp/pid" 2>/dev/null)
+	[ -n "$pid" ] && kill "$pid"
+	for i in $(seq 30); do
+		kill -0 "$pid" 2>/dev/null || return
+		sleep 0.1
+	done
+}
+
+echo "0123456789abcdef0123456789abcdef" > "$tmp/key"
+start
+
+valid=$(sign "$(now) identify 5")
+echo "$valid" | send
+expect valid accepted 1
+
+forged=$(sign "$(now) identify 5")
+case "$forged" in *0) forged=${forged%0}1 ;; *) forged=${forged%?}0 ;; esac
+echo "$forged" | send
+expect forged rejected 1
+expect forged accepted 1
+
+echo "$valid" | send
+expect replayed replayed 1
+
+sign "$(($(now) - 60000)) identify 5" | send
+expect stale replayed 2
+expect stale rejected 3
+
+# A full bucket lets 10 through, the rest of the flood is not looked at.
+# A token or two may come back while it is sent.
+sleep 2
+stamp=$(now)
+for i in $(seq 40); do
+	echo "$stamp identify"
+done | send
+expect flood received 44
+expect flood limited 28 30
+expect flood rejected 13 15
+stop
+
+# A key longer than 64 bytes would be cut and never verify, it is refused
+printf '%080d\n' 0 > "$tmp/key"
+start
+sign "$(now) identify 5" | send
+expect long-key received 0
+stop
+
+rm -rf "$tmp"
+exit $failed
@@ -0,0 +1,28 @@
+#!/bin/sh
+# Golden trace tests: every tests/sim/*.sim script runs through the
+# simulator and its trace must match the .out next to it exactly. The
+# "# args:" line of a script holds the daemon arguments, run from the
+# script's directory. The CPU time is the only part of a trace that varies
+# and is cut. UPDATE=1 rewrites the expected traces after a deliberate
+# change, review their diff before committing it.
+
+ledd=$(cd "$(dirname "$0")/.." && pwd)/ledd
+cd "$(dirname "$0")/sim" || exit 1
+failed=0
+
+for script in *.sim; do
+	expected=${script%.sim}.out
+	args=$(sed -n 's/^# args: //p' "$script")
+	actual=$("$ledd" -T "$script" $args 2>/dev/null | sed 's/, [0-9.]* ms CPU$//')
+	if [ -n "$UPDATE" ]; then
+		printf '%s\n' "$actual" > "$expected"
+		echo "UPDATED $script"
+	elif printf '%s\n' "$actual" | diff -u "$expected" - >/dev/null 2>&1; then
+		echo "PASS $script"
+	else
+		printf '%s\n' "$actual" | diff -u "$expected" -
+		echo "FAIL $script"
+		failed=1
+	fi
+done
+exit $failed
@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../ledd.h"
+
+// Stage machine tables: the built-in machine, "*" expansion, guards, file
+// order, and configs that must be rejected with their line number.
+
+static int failures;
+static char conf[] = "/tmp/stage_test.XXXXXX";
+static char err[] = "/tmp/stage_test.err.XXXXXX";
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+// Load a config from its text, stderr goes to err
+static int load(struct stage_machine *m, const char *text) {
+	FILE *fp = fopen(conf, "w");
+	if (fp == NULL) {
+		return -2;
+	}
+	fputs(text, fp);
+	fclose(fp);
+	fflush(stderr);
+	if (freopen(err, "w", stderr) == NULL) {
+		return -2;
+	}
+	return stage_load(m, conf);
+}
+
+static int state(const struct stage_machine *m, const char *name) {
+	for (int i = 0; i < m->nstates; i++) {
+		if (strcmp(m->states[i].name, name) == 0) {
+			return i;
+		}
+	}
+	return -100;
+}
+
+// The last error stage_load reported names the line
+static int error_line(void) {
+	char line[256];
+	char prefix[64];
+	int lineno = 0;
+
+	fflush(stderr);
+	FILE *fp = fopen(err, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+	snprintf(prefix, sizeof(prefix), "%s:%%d: ", conf);
+	if (fgets(line, sizeof(line), fp) == NULL || sscanf(line, prefix, &lineno) != 1) {
+		lineno = -1;
+	}
+	fclose(fp);
+	return lineno;
+}
+
+static void test_default(void) {
+	struct stage_machine m;
+
+	CHECK(stage_load(&m, NULL) == 0);
+	int idle = state(&m, "idle"), boot = state(&m, "boot");
+	CHECK(idle == 0);
+	CHECK(strcmp(m.states[boot].spec, "file") == 0);
+	CHECK(m.states[idle].spec[0] == '\0');
+	CHECK(stage_next(&m, idle, STAGE_PRESENT, "") == boot);
+	CHECK(stage_next(&m, idle, STAGE_CHANGED, "") == boot);
+	CHECK(stage_next(&m, boot, STAGE_CHANGED, "") == boot);
+	CHECK(stage_next(&m, boot, STAGE_ABSENT, "") == idle);
+	CHECK(stage_next(&m, idle, STAGE_ABSENT, "") == -1);
+	CHECK(stage_next(&m, boot, STAGE_PRESENT, "") == -1);
+	CHECK(!m.guarded);
+}
+
+static void test_wildcard(void) {
+	struct stage_machine m;
+
+	CHECK(load(&m,
+	           "state off off\n"
+	           "state boot file\n"
+	           "state net heartbeat 1 blue\n"
+	           "* absent -> off\n"
+	           "* long -> net\n") == 0);
+	int off = state(&m, "off"), boot = state(&m, "boot"), net = state(&m, "net");
+	CHECK(m.states[net].half_ms == 1000);
+	CHECK(m.states[net].color == color_lookup("blue"));
+	CHECK(stage_next(&m, boot, STAGE_ABSENT, "") == off);
+	CHECK(stage_next(&m, net, STAGE_ABSENT, "") == off);
+	CHECK(stage_next(&m, off, STAGE_LONG, "") == net);
+	CHECK(stage_next(&m, boot, STAGE_LONG, "") == net);
+	// Not in the cell of the state it leads to, so a polled event does not
+	// re-enter it
+	CHECK(stage_next(&m, off, STAGE_ABSENT, "") == -1);
+	CHECK(m.count[off][STAGE_ABSENT] == 0);
+	CHECK(stage_next(&m, net, STAGE_LONG, "") == -1);
+	// No rule at all
+	CHECK(stage_next(&m, boot, STAGE_SHORT, "") == -1);
+}
+
+static void test_guards(void) {
+	struct stage_machine m;
+
+	CHECK(load(&m,
+	           "# Comments and blank lines are fine\n"
+	           "\n"
+	           "state boot file\n"
+	           "state net heartbeat\n"
+	           "state fail blink 0.1 red  # trailing comment\n"
+	           "boot changed net -> net\n"
+	           "boot changed fail -> fail\n"
+	           "boot changed -> boot\n"
+	           "boot changed never -> net\n"
+	           "net changed fail -> fail\n") == 0);
+	int boot = state(&m, "boot"), net = state(&m, "net"), fail = state(&m, "fail");
+	CHECK(m.guarded);
+	CHECK(m.count[boot][STAGE_CHANGED] == 4);
+	CHECK(stage_next(&m, boot, STAGE_CHANGED, "net") == net);
+	CHECK(stage_next(&m, boot, STAGE_CHANGED, "fail") == fail);
+	// The first rule whose guard holds wins, so the unguarded one shadows
+	// the rule after it
+	CHECK(stage_next(&m, boot, STAGE_CHANGED, "never") == boot);
+	CHECK(stage_next(&m, boot, STAGE_CHANGED, "") == boot);
+	CHECK(stage_next(&m, net, STAGE_CHANGED, "fail") == fail);
+	CHECK(stage_next(&m, net, STAGE_CHANGED, "net") == -1);
+	CHECK(stage_next(&m, fail, STAGE_CHANGED, "net") == -1);
+}
+
+static void test_order(void) {
+	struct stage_machine m;
+
+	// A "*" rule keeps its place in file order among the specific ones
+	CHECK(load(&m,
+	           "state a off\n"
+	           "state b off\n"
+	           "state c off\n"
+	           "a short -> b\n"
+	           "* short -> c\n"
+	           "b short -> a\n") == 0);
+	int a = state(&m, "a"), b = state(&m, "b"), c = state(&m, "c");
+	CHECK(stage_next(&m, a, STAGE_SHORT, "") == b);
+	CHECK(stage_next(&m, b, STAGE_SHORT, "") == c);
+	CHECK(stage_next(&m, c, STAGE_SHORT, "") == -1);
+	CHECK(m.count[a][STAGE_SHORT] == 2);
+	CHECK(m.count[b][STAGE_SHORT] == 2);
+}
+
+static void test_rejected(void) {
+	struct stage_machine m;
+
+	CHECK(load(&m, "state a off\nstate b off\na reboot -> b\n") == -1);
+	CHECK(error_line() == 3);
+	CHECK(load(&m, "state a off\n\nstate b blink:nonsense\n") == -1);
+	CHECK(error_line() == 3);
+	CHECK(load(&m, "state a nosuchpattern\n") == -1);
+	CHECK(error_line() == 1);
+	CHECK(load(&m, "state a off\na present -> b\nstate b off\n") == -1);
+	CHECK(error_line() == 2);
+	CHECK(load(&m, "state a off\nstate a off\n") == -1);
+	CHECK(error_line() == 2);
+	CHECK(load(&m, "state a off purple-ish\n") == -1);
+	CHECK(error_line() == 1);
+	CHECK(load(&m, "state a off\na present b\n") == -1);
+	CHECK(error_line() == 2);
+	CHECK(load(&m, "# nothing\n") == -1);
+	CHECK(stage_load(&m, "/nonexistent/stages.conf") == -1);
+}
+
+int main(void) {
+	int fd = mkstemp(conf);
+	int efd = mkstemp(err);
+	if (fd < 0 || efd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+	close(efd);
+
+	test_default();
+	test_wildcard();
+	test_guards();
+	test_order();
+	test_rejected();
+
+	unlink(conf);
+	unlink(err);
+	printf("%s stage\n", failures ? "FAIL" : "PASS");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,60 @@
+#!/bin/sh
+# Wakeup budget tests: the real daemon runs against the in-process I2C mock
+# while voluntary_ctxt_switches (one per sleep in poll()) and utime+stime
+# are sampled from /proc over a window. Idle with inotify the budget is no
+# wakeup at all, blinking it is two per period, one per edge, however many
+# LEDs blink. One more is allowed for an edge on the window's boundary.
+
+ledd=$(cd "$(dirname "$0")/.." && pwd)/ledd
+tmp=$(mktemp -d /tmp/ledd-test.XXXXXX) || exit 1
+window=4
+failed=0
+
+switches() {
+	sed -n 's/^voluntary_ctxt_switches:[[:space:]]*//p' "/proc/$1/status"
+}
+
+# utime + stime in clock ticks, after the parenthesised name
+ticks() {
+	sed 's/.*) //' "/proc/$1/stat" | awk '{ print $12 + $13 }'
+}
+
+# <name> <wakeup budget> <cpu tick budget> <file contents or "-" for none> <args...>
+scenario() {
+	name=$1 budget=$2 cpu=$3 contents=$4
+	shift 4
+	rm -f "$tmp/boot" "$tmp/pid"
+	[ "$contents" = - ] || echo "$contents" > "$tmp/boot"
+	"$ledd" -L "$tmp/pid" "$@" "$tmp/boot" 2>/dev/null
+	for i in 1 2 3 4 5 6 7 8 9 10; do
+		pid=$(cat "$tmp/pid" 2>/dev/null)
+		[ -n "$pid" ] && break
+		sleep 0.1
+	done
+	if [ -z "$pid" ]; then
+		echo "FAIL $name: daemon did not start"
+		failed=1
+		return
+	fi
+	sleep 1  # Startup and crossfades settle
+	s0=$(switches "$pid") t0=$(ticks "$pid")
+	sleep $window
+	s1=$(switches "$pid") t1=$(ticks "$pid")
+	kill "$pid"
+	wakeups=$((s1 - s0)) used=$((t1 - t0))
+	if [ $wakeups -le "$budget" ] && [ $used -le "$cpu" ]; then
+		echo "PASS $name: $wakeups wakeups (budget $budget), $used ticks CPU (budget $cpu)"
+	else
+		echo "FAIL $name: $wakeups wakeups (budget $budget), $used ticks CPU (budget $cpu)"
+		failed=1
+	fi
+	sleep 0.2
+}
+
+# A 0.5 s interval is a 1 s period
+scenario idle 0 1 - -i mock:0x40:pca9685 0.5
+scenario blinking $((window * 2 + 1)) 5 0.5 -i mock:0x40:pca9685 0.5
+scenario multi-led $((window * 2 + 1)) 5 "0.5 white" -i mock:0x40:pca9685:r,g,b 0.5
+
+rm -rf "$tmp"
+exit $failed
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../ledd.h"
+
+// WS2812 backend against the in-process mock: the encoded stream of known
+// frames, and unchanged frames staying off the wire.
+
+#define LEAD  1
+#define RESET 90
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+// Each data bit is three SPI bits, 100 for 0 and 110 for 1
+static const uint8_t enc_00[3] = { 0x92, 0x49, 0x24 };
+static const uint8_t enc_ff[3] = { 0xdb, 0x6d, 0xb6 };
+static const uint8_t enc_80[3] = { 0xd2, 0x49, 0x24 };
+
+static void set_pixel(struct led *led, const char *color, uint8_t level) {
+	led->color = (uint8_t)color_lookup(color);
+	led->level = level;
+	led->dirty = 1;
+}
+
+// Wire byte pos (0..2) of a pixel
+static int stream_is(int pixel, int pos, const uint8_t *enc) {
+	return memcmp(&ws2812_mock_stream[LEAD + pixel * 9 + pos * 3], enc, 3) == 0;
+}
+
+static int framing_is_low(int npixels) {
+	if (ws2812_mock_stream[0] != 0) {
+		return 0;
+	}
+	for (int i = 0; i < RESET; i++) {
+		if (ws2812_mock_stream[LEAD + npixels * 9 + i] != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void test_frames(void) {
+	struct led leds[MAX_LEDS];
+	struct ws2812_stats before;
+
+	int count = ws2812_parse("mock:2", leds);
+	CHECK(count == 2);
+
+	// Open sends an all-off frame
+	before = ws2812_stats;
+	ws2812_mock_len = 0;
+	CHECK(backend_ws2812.open(leds, count) == 0);
+	CHECK(ws2812_stats.frames - before.frames == 1);
+	CHECK(ws2812_mock_len == LEAD + 2 * 9 + RESET);
+	for (int p = 0; p < 2; p++) {
+		for (int c = 0; c < 3; c++) {
+			CHECK(stream_is(p, c, enc_00));
+		}
+	}
+	CHECK(framing_is_low(2));
+
+	// Green first on the wire: full red, then blue at half level
+	before = ws2812_stats;
+	set_pixel(&leds[0], "red", LEVEL_ON);
+	set_pixel(&leds[1], "blue", 128);
+	CHECK(backend_ws2812.write(leds, count) == 0);
+	CHECK(ws2812_stats.frames - before.frames == 1);
+	CHECK(ws2812_stats.bytes - before.bytes == (unsigned long)ws2812_mock_len);
+	CHECK(stream_is(0, 0, enc_00));
+	CHECK(stream_is(0, 1, enc_ff));
+	CHECK(stream_is(0, 2, enc_00));
+	CHECK(stream_is(1, 0, enc_00));
+	CHECK(stream_is(1, 1, enc_00));
+	CHECK(stream_is(1, 2, enc_80));
+	CHECK(framing_is_low(2));
+	CHECK(!leds[0].dirty && !leds[1].dirty);
+
+	// The same frame again is not retransmitted
+	before = ws2812_stats;
+	ws2812_mock_len = 0;
+	set_pixel(&leds[0], "red", LEVEL_ON);
+	CHECK(backend_ws2812.write(leds, count) == 0);
+	CHECK(ws2812_mock_len == 0);
+	CHECK(ws2812_stats.frames == before.frames);
+	CHECK(ws2812_stats.bytes == before.bytes);
+	CHECK(ws2812_stats.skipped - before.skipped == 1);
+
+	// Going back to a frame sent before is a change from the one shown
+	set_pixel(&leds[0], "red", LEVEL_OFF);
+	set_pixel(&leds[1], "blue", LEVEL_OFF);
+	CHECK(backend_ws2812.write(leds, count) == 0);
+	set_pixel(&leds[0], "red", LEVEL_ON);
+	set_pixel(&leds[1], "blue", 128);
+	ws2812_mock_len = 0;
+	CHECK(backend_ws2812.write(leds, count) == 0);
+	CHECK(ws2812_mock_len == LEAD + 2 * 9 + RESET);
+	CHECK(stream_is(0, 1, enc_ff));
+	CHECK(stream_is(1, 2, enc_80));
+
+	backend_ws2812.close(leds, count);
+}
+
+static void test_order(void) {
+	struct led leds[MAX_LEDS];
+
+	int count = ws2812_parse("mock:1:brg", leds);
+	CHECK(count == 1);
+	CHECK(backend_ws2812.open(leds, count) == 0);
+	set_pixel(&leds[0], "red", LEVEL_ON);
+	CHECK(backend_ws2812.write(leds, count) == 0);
+	CHECK(ws2812_mock_len == LEAD + 9 + RESET);
+	CHECK(stream_is(0, 0, enc_00));
+	CHECK(stream_is(0, 1, enc_ff));
+	CHECK(stream_is(0, 2, enc_00));
+	backend_ws2812.close(leds, count);
+
+	CHECK(ws2812_parse("mock:1:rgx", leds) == -1);
+	CHECK(ws2812_parse("mock:0", leds) == -1);
+}
+
+int main(void) {
+	test_frames();
+	test_order();
+	printf("%s ws2812\n", failures ? "FAIL" : "PASS");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "ledd.h"
+
+// Trace of edges, wakeups and event dispatch. Events go into a fixed ring,
+// the oldest being overwritten, and are exported as Chrome trace JSON that
+// Perfetto and chrome://tracing load. Each event can also be mirrored to the
+// ftrace marker, so it shows up in a kernel trace next to the scheduling of
+// every other thread. Timestamps are CLOCK_MONOTONIC like the kernel's.
+
+#define TRACE_RING_SIZE 4096
+#define TRACE_MARKER "/sys/kernel/tracing/trace_marker"
+#define TRACE_MARKER_OLD "/sys/kernel/debug/tracing/trace_marker"
+
+struct trace_event {
+	uint64_t ts;       // us
+	uint32_t dur;      // us, dispatch only
+	uint8_t type;      // enum trace_type
+	uint8_t value;
+	const char *name;  // Static string or LED name, never freed
+};
+
+static struct trace_event ring[TRACE_RING_SIZE];
+static unsigned long ring_head;  // Events recorded so far
+static int marker_fd = -1;
+int trace_enabled;
+
+static const char *const type_names[] = {
+	[TRACE_EDGE] = "edge",
+	[TRACE_WAKEUP] = "wakeup",
+	[TRACE_DISPATCH] = "dispatch",
+};
+
+uint64_t trace_now(void) {
+	if (sim_active) {
+		return sim_now * 1000;
+	}
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+int trace_open(int ftrace) {
+	trace_enabled = 1;
+	if (!ftrace) {
+		return 0;
+	}
+	marker_fd = open(TRACE_MARKER, O_WRONLY | O_CLOEXEC);
+	if (marker_fd < 0) {
+		marker_fd = open(TRACE_MARKER_OLD, O_WRONLY | O_CLOEXEC);
+	}
+	if (marker_fd < 0) {
+		syslog(LOG_WARNING, "Failed to open trace_marker: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+void trace_close(void) {
+	if (marker_fd >= 0) {
+		close(marker_fd);
+		marker_fd = -1;
+	}
+	trace_enabled = 0;
+}
+
+static void trace_record(enum trace_type type, const char *name, uint8_t value, uint64_t ts,
+                         uint32_t dur) {
+	struct trace_event *ev = &ring[ring_head++ % TRACE_RING_SIZE];
+	ev->ts = ts;
+	ev->dur = dur;
+	ev->type = (uint8_t)type;
+	ev->value = value;
+	ev->name = name;
+
+	if (marker_fd >= 0) {
+		char buf[MAX_BUF];
+		int len = snprintf(buf, sizeof(buf), "ledd: %s %s %u\n", type_names[type], name,
+		                   type == TRACE_DISPATCH ? (unsigned int)dur : (unsigned int)value);
+		if (len > 0 && write(marker_fd, buf, (size_t)len) < 0) {
+			close(marker_fd);  // Tracing turned off underneath us, stop trying
+			marker_fd = -1;
+		}
+	}
+}
+
+void trace_edge(const char *led, uint8_t level) {
+	if (trace_enabled) {
+		trace_record(TRACE_EDGE, led, level, trace_now(), 0);
+	}
+}
+
+// A wakeup from poll(), "why" is what woke the loop
+void trace_wakeup(const char *why) {
+	if (trace_enabled) {
+		trace_record(TRACE_WAKEUP, why, 0, trace_now(), 0);
+	}
+}
+
+// Handling of an event that started at "start" (from trace_now) and ends now
+void trace_dispatch(const char *what, uint64_t start) {
+	if (trace_enabled) {
+		uint64_t end = trace_now();
+		trace_record(TRACE_DISPATCH, what, 0, start, (uint32_t)(end - start));
+	}
+}
+
+// Edges are counters, one track per LED, wakeups are instants and
+// dispatches are complete events
+int trace_export(const char *path) {
+	unsigned long first = ring_head > TRACE_RING_SIZE ? ring_head - TRACE_RING_SIZE : 0;
+	int pid = (int)getpid();
+
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL) {
+		syslog(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
+		return -1;
+	}
+	fprintf(fp, "{\"traceEvents\":[\n");
+	for (unsigned long i = first; i < ring_head; i++) {
+		const struct trace_event *ev = &ring[i % TRACE_RING_SIZE];
+		const char *sep = i + 1 < ring_head ? "," : "";
+		switch (ev->type) {
+		case TRACE_EDGE:
+			fprintf(fp, "{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%llu,\"pid\":%d,\"tid\":%d,"
+			        "\"args\":{\"level\":%u}}%s\n", ev->name, (unsigned long long)ev->ts,
+			        pid, pid, (unsigned int)ev->value, sep);
+			break;
+		case TRACE_WAKEUP:
+			fprintf(fp, "{\"name\":\"wakeup\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":%d,"
+			        "\"tid\":%d,\"args\":{\"by\":\"%s\"}}%s\n", (unsigned long long)ev->ts,
+			        pid, pid, ev->name, sep);
+			break;
+		case TRACE_DISPATCH:
+			fprintf(fp, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%u,\"pid\":%d,"
+			        "\"tid\":%d}%s\n", ev->name, (unsigned long long)ev->ts,
+			        (unsigned int)ev->dur, pid, pid, sep);
+			break;
+		}
+	}
+	fprintf(fp, "],\"displayTimeUnit\":\"ms\"}\n");
+	if (fclose(fp) != 0) {
+		syslog(LOG_ERR, "Failed to write %s: %s", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
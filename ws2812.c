@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+
+#include "ledd.h"
+
+// Addressable WS2812 pixels on the MOSI line of a spidev device. Each data
+// bit becomes three SPI bits at 2.4 MHz (100 for 0, 110 for 1), so a color
+// byte is three SPI bytes taken from a table built once at open. A frame is
+// encoded into the back buffer and only sent, as one SPI_IOC_MESSAGE, when
+// it differs from the frame on the strip; the buffers then swap.
+
+#define WS2812_SPI_HZ     2400000
+#define WS2812_LEAD_BYTES 1    // Keep MOSI low before the first bit
+#define WS2812_RESET_BYTES 90  // 300 us low latches the frame on newer parts
+#define WS2812_PIXEL_BYTES (3 * 3)
+#define WS2812_FRAME_MAX  (WS2812_LEAD_BYTES + MAX_LEDS * WS2812_PIXEL_BYTES + WS2812_RESET_BYTES)
+
+struct ws2812_strip {
+	int bus;               // -1 for the in-process mock
+	int cs;
+	int fd;
+	int npixels;
+	uint8_t order[3];      // Wire position of r, g and b
+	int len;               // Encoded frame length
+	uint8_t frames[2][WS2812_FRAME_MAX];
+	int front;             // Frame on the strip
+	int have_front;        // frames[front] is valid
+};
+
+static struct ws2812_strip strip;
+static uint8_t expand[256][3];
+struct ws2812_stats ws2812_stats;
+
+// In-process mock of the spidev fd, captures the last transmitted stream
+uint8_t ws2812_mock_stream[WS2812_FRAME_MAX];
+int ws2812_mock_len;
+
+// "<bus>.<cs>|mock:<pixels>[:<order>]", pixels are named px<N>
+int ws2812_parse(const char *spec, struct led *leds) {
+	char buf[MAX_BUF];
+	char *save = NULL;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	char *dev = strtok_r(buf, ":", &save);
+	char *pixels = strtok_r(NULL, ":", &save);
+	char *order = strtok_r(NULL, ":", &save);
+	if (dev == NULL || pixels == NULL) {
+		return -1;
+	}
+
+	memset(&strip, 0, sizeof(strip));
+	strip.fd = -1;
+	if (strcmp(dev, "mock") == 0) {
+		strip.bus = -1;
+	} else if (sscanf(dev, "%d.%d", &strip.bus, &strip.cs) != 2 || strip.bus < 0 || strip.cs < 0) {
+		return -1;
+	}
+	strip.npixels = (int)strtol(pixels, NULL, 10);
+	if (strip.npixels <= 0 || strip.npixels > MAX_LEDS) {
+		return -1;
+	}
+
+	// WS2812 take green first
+	if (order == NULL) {
+		order = "grb";
+	}
+	if (strlen(order) != 3) {
+		return -1;
+	}
+	for (int c = 0; c < 3; c++) {
+		const char *pos = strchr(order, "rgb"[c]);
+		if (pos == NULL) {
+			return -1;
+		}
+		strip.order[c] = (uint8_t)(pos - order);
+	}
+
+	for (int i = 0; i < strip.npixels; i++) {
+		struct led *led = &leds[i];
+		memset(led, 0, sizeof(*led));
+		snprintf(led->name, sizeof(led->name), "px%u", (unsigned char)i);
+		led->gpio = -1;
+		led->bit = i;
+		led->color = (uint8_t)color_lookup("white");
+	}
+	strip.len = WS2812_LEAD_BYTES + strip.npixels * WS2812_PIXEL_BYTES + WS2812_RESET_BYTES;
+	return strip.npixels;
+}
+
+static void ws2812_build_table(void) {
+	for (int b = 0; b < 256; b++) {
+		uint32_t bits = 0;
+		for (int i = 7; i >= 0; i--) {
+			bits = (bits << 3) | ((b >> i) & 1 ? 0x6 : 0x4);
+		}
+		expand[b][0] = (uint8_t)(bits >> 16);
+		expand[b][1] = (uint8_t)(bits >> 8);
+		expand[b][2] = (uint8_t)bits;
+	}
+}
+
+static int ws2812_transfer(const uint8_t *buf, int len) {
+	if (strip.bus == -1) {
+		memcpy(ws2812_mock_stream, buf, (size_t)len);
+		ws2812_mock_len = len;
+		return 0;
+	}
+
+	struct spi_ioc_transfer xfer = {
+		.tx_buf = (unsigned long)buf,
+		.len = (uint32_t)len,
+		.speed_hz = WS2812_SPI_HZ,
+		.bits_per_word = 8,
+	};
+	return ioctl(strip.fd, SPI_IOC_MESSAGE(1), &xfer) < 0 ? -1 : 0;
+}
+
+static int ws2812_write(struct led *leds, int count) {
+	uint8_t *back = strip.frames[!strip.front];
+	uint8_t *out = back + WS2812_LEAD_BYTES;
+
+	// Every pixel is re-encoded, at three table lookups per channel that is
+	// cheaper than tracking which bytes of the back buffer are stale
+	for (int i = 0; i < count; i++) {
+		const uint8_t *rgb = color_rgb(leds[i].color);
+		uint8_t *px = out + leds[i].bit * WS2812_PIXEL_BYTES;
+		for (int c = 0; c < 3; c++) {
+			uint8_t v = (uint8_t)((rgb[c] * leds[i].level + LEVEL_ON / 2) / LEVEL_ON);
+			memcpy(px + 3 * strip.order[c], expand[v], 3);
+		}
+		leds[i].dirty = 0;
+	}
+
+	if (strip.have_front && memcmp(back, strip.frames[strip.front], (size_t)strip.len) == 0) {
+		ws2812_stats.skipped++;
+		return 0;
+	}
+	if (ws2812_transfer(back, strip.len) == -1) {
+		syslog(LOG_ERR, "SPI write to spidev%d.%d failed: %s", strip.bus, strip.cs, strerror(errno));
+		strip.have_front = 0;  // Unknown state, send the next frame regardless
+		return -1;
+	}
+	strip.front = !strip.front;
+	strip.have_front = 1;
+	ws2812_stats.frames++;
+	ws2812_stats.bytes += (unsigned long)strip.len;
+	return 0;
+}
+
+static int ws2812_open(struct led *leds, int count) {
+	if (strip.bus != -1) {
+		char path[MAX_BUF];
+		uint8_t mode = SPI_MODE_0;
+		uint8_t bits = 8;
+		uint32_t speed = WS2812_SPI_HZ;
+		snprintf(path, sizeof(path), "/dev/spidev%d.%d", strip.bus, strip.cs);
+		strip.fd = open(path, O_RDWR | O_CLOEXEC);
+		if (strip.fd < 0) {
+			syslog(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
+			return -1;
+		}
+		if (ioctl(strip.fd, SPI_IOC_WR_MODE, &mode) < 0 ||
+		    ioctl(strip.fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
+		    ioctl(strip.fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0) {
+			syslog(LOG_ERR, "Failed to configure %s: %s", path, strerror(errno));
+			close(strip.fd);
+			strip.fd = -1;
+			return -1;
+		}
+	}
+
+	// Lead-in and reset bytes stay zero in both buffers
+	ws2812_build_table();
+	memset(strip.frames, 0, sizeof(strip.frames));
+	strip.have_front = 0;
+	for (int i = 0; i < count; i++) {
+		leds[i].level = LEVEL_OFF;
+	}
+	return ws2812_write(leds, count);
+}
+
+static void ws2812_close(struct led *leds, int count) {
+	(void)leds;
+	(void)count;
+	if (strip.fd >= 0) {
+		close(strip.fd);
+		strip.fd = -1;
+	}
+}
+
+const struct led_backend backend_ws2812 = {
+	.name = "ws2812",
+	.caps = LED_CAP_PWM | LED_CAP_RGB,
+	.frame_ms = 20,  // 60 pixels take under 2 ms on the wire
+	.open = ws2812_open,
+	.write = ws2812_write,
+	.close = ws2812_close,
+};